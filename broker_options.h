@@ -0,0 +1,177 @@
+#ifndef MQTTSUBSCRIPTION_BROKER_OPTIONS_H
+#define MQTTSUBSCRIPTION_BROKER_OPTIONS_H
+
+#include <mqtt/string_view.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/lexical_cast.hpp>
+#include "logger.h"
+#include "outbound_queue.h"
+#include "shared_subscription.h"
+#include "offline_queue.h"
+
+// Command line options of the broker:
+//   MQTTSubscription port [threads] [--option=value ...]
+struct broker_options
+{
+    std::uint16_t port;
+    std::size_t threads;
+    log_level level;
+
+    // Retained messages sent to a new subscription before yielding to other connections
+    std::size_t retained_batch_size;
+
+    // Queued publishes of a session above which sending retained messages waits
+    std::size_t retained_max_queued;
+
+    // Publish topics of which each thread caches the subscribers, 0 disables the cache
+    std::size_t match_cache_size;
+
+    // Batching and limits of the publishes queued by every session
+    outbound_limits outbound;
+
+    // Selection of the member of a shared subscription group receiving a publish
+    shared_delivery shared_delivery_mode;
+
+    // Directory storing the retained messages, empty keeps them in memory only
+    std::string retained_store;
+
+    // Interval at which the log of the retained store is synced
+    std::chrono::milliseconds retained_sync_interval;
+
+    // Size of the retained log above which it is compacted into a snapshot
+    std::size_t retained_compact_bytes;
+
+    // Publishes queued for every persistent session while its client is disconnected
+    offline_limits offline;
+
+    // Interval at which the metrics are published on the $SYS topics, 0 disables the metrics
+    std::chrono::seconds metrics_interval;
+
+    // File the metrics are written to in the Prometheus text format, empty disables the file
+    std::string metrics_file;
+
+    broker_options()
+            : port(0), threads(1), level(log_level::info), retained_batch_size(64), retained_max_queued(256), match_cache_size(4096),
+              shared_delivery_mode(shared_delivery::round_robin), retained_sync_interval(10), retained_compact_bytes(64 * 1024 * 1024),
+              metrics_interval(10)
+    { }
+
+    static void usage(char const *program)
+    {
+        std::cout << program << " port [threads] [--option=value ...]" << std::endl
+                  << "Options:" << std::endl
+                  << "  --log-level=trace|debug|info|warning|error|none (default info)" << std::endl
+                  << "  --retained-batch-size=N   retained messages sent per batch (default 64)" << std::endl
+                  << "  --retained-max-queued=N   queued publishes before retained messages wait (default 256)" << std::endl
+                  << "  --match-cache-size=N      publish topics with cached subscribers per thread, 0 disables (default 4096)" << std::endl
+                  << "  --write-batch-bytes=N     bytes of publishes written to a connection at once (default 65536)" << std::endl
+                  << "  --write-batch-delay-us=N  microseconds to wait for more publishes to write at once (default 0)" << std::endl
+                  << "  --max-queued-messages=N   publishes queued per session (default 10000)" << std::endl
+                  << "  --max-queued-bytes=N      bytes of publishes queued per session (default 16777216)" << std::endl
+                  << "  --receive-maximum=N       QoS 1 and 2 publishes in flight per session, 1-65535 (default 32)" << std::endl
+                  << "  --retransmit-ms=N         milliseconds before an unacknowledged publish is sent again (default 20000)" << std::endl
+                  << "  --slow-consumer=drop-oldest-qos0|drop-newest|disconnect" << std::endl
+                  << "                            when a session queue is full (default drop-oldest-qos0)" << std::endl
+                  << "  --shared-delivery=round-robin|least-queued" << std::endl
+                  << "                            member of a $share group receiving a publish (default round-robin)" << std::endl
+                  << "  --retained-store=DIR      store the retained messages in DIR (default memory only)" << std::endl
+                  << "  --retained-sync-ms=N      milliseconds between syncs of the retained log (default 10)" << std::endl
+                  << "  --retained-compact-bytes=N  retained log size written to a snapshot (default 67108864)" << std::endl
+                  << "  --offline-memory-bytes=N  bytes queued in memory per disconnected session (default 65536)" << std::endl
+                  << "  --offline-max-bytes=N     bytes queued per disconnected session (default 67108864)" << std::endl
+                  << "  --offline-dir=DIR         directory of the offline queues spilled to disk (default temp directory)" << std::endl
+                  << "  --metrics-interval-s=N    seconds between metrics published on $SYS, 0 disables (default 10)" << std::endl
+                  << "  --metrics-file=PATH       write the metrics to PATH in the Prometheus text format (default none)" << std::endl;
+    }
+
+    static std::size_t parse_count(MQTT_NS::string_view const &value)
+    {
+        return boost::lexical_cast<std::size_t>(std::string(value.data(), value.size()));
+    }
+
+    // Parse the command line, throws when an option is not valid
+    static broker_options parse(int argc, char **argv)
+    {
+        if(argc < 2)
+            throw std::runtime_error("Missing port");
+
+        broker_options result;
+        result.port = boost::lexical_cast<std::uint16_t>(argv[1]);
+
+        for(int i = 2; i < argc; ++i) {
+            MQTT_NS::string_view arg(argv[i]);
+
+            if(arg.substr(0, 2) != "--") {
+                if(i != 2)
+                    throw std::runtime_error("Unexpected argument: " + std::string(argv[i]));
+                result.threads = boost::lexical_cast<std::size_t>(argv[i]);
+                continue;
+            }
+
+            auto separator = arg.find('=');
+            if(separator == MQTT_NS::string_view::npos)
+                throw std::runtime_error("Option without value: " + std::string(argv[i]));
+
+            MQTT_NS::string_view name = arg.substr(2, separator - 2);
+            MQTT_NS::string_view value = arg.substr(separator + 1);
+
+            if(name == "log-level")
+                result.level = log_level_from_name(value);
+            else if(name == "retained-batch-size")
+                result.retained_batch_size = parse_count(value);
+            else if(name == "retained-max-queued")
+                result.retained_max_queued = parse_count(value);
+            else if(name == "match-cache-size")
+                result.match_cache_size = parse_count(value);
+            else if(name == "write-batch-bytes")
+                result.outbound.max_batch_bytes = parse_count(value);
+            else if(name == "write-batch-delay-us")
+                result.outbound.max_batch_delay = std::chrono::microseconds(parse_count(value));
+            else if(name == "max-queued-messages")
+                result.outbound.max_queued_messages = parse_count(value);
+            else if(name == "max-queued-bytes")
+                result.outbound.max_queued_bytes = parse_count(value);
+            else if(name == "receive-maximum")
+                result.outbound.receive_maximum = parse_count(value);
+            else if(name == "retransmit-ms")
+                result.outbound.retransmit_interval = std::chrono::milliseconds(parse_count(value));
+            else if(name == "slow-consumer")
+                result.outbound.policy = slow_consumer_policy_from_name(value);
+            else if(name == "shared-delivery")
+                result.shared_delivery_mode = shared_delivery_from_name(value);
+            else if(name == "retained-store")
+                result.retained_store.assign(value.data(), value.size());
+            else if(name == "retained-sync-ms")
+                result.retained_sync_interval = std::chrono::milliseconds(parse_count(value));
+            else if(name == "retained-compact-bytes")
+                result.retained_compact_bytes = parse_count(value);
+            else if(name == "offline-memory-bytes")
+                result.offline.memory_bytes = parse_count(value);
+            else if(name == "offline-max-bytes")
+                result.offline.max_bytes = parse_count(value);
+            else if(name == "offline-dir")
+                result.offline.directory.assign(value.data(), value.size());
+            else if(name == "metrics-interval-s")
+                result.metrics_interval = std::chrono::seconds(parse_count(value));
+            else if(name == "metrics-file")
+                result.metrics_file.assign(value.data(), value.size());
+            else
+                throw std::runtime_error("Unknown option: " + std::string(argv[i]));
+        }
+
+        if(result.threads == 0)
+            throw std::runtime_error("The number of threads must be at least 1");
+        if(result.outbound.receive_maximum == 0 || result.outbound.receive_maximum > 65535)
+            throw std::runtime_error("The receive maximum must be between 1 and 65535");
+
+        return result;
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_BROKER_OPTIONS_H
@@ -0,0 +1,71 @@
+#ifndef MQTTSUBSCRIPTION_CONCURRENT_TOPIC_MAP_H
+#define MQTTSUBSCRIPTION_CONCURRENT_TOPIC_MAP_H
+
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+// Reader-writer protected wrapper around a subscription_map or retained_topic_map. Any number
+// of threads can search the map at the same time, modifications are exclusive. The find
+// callback is invoked while the read lock is held, so it should not modify the map.
+template<typename Map>
+class concurrent_topic_map
+{
+    mutable std::shared_mutex mutex;
+    Map map;
+
+public:
+    typedef Map map_type;
+
+    template<typename... Args>
+    auto insert(Args&&... args)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map.insert(std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    auto insert_or_update(Args&&... args)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map.insert_or_update(std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    auto remove(Args&&... args)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map.remove(std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    auto find(Args&&... args) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return map.find(std::forward<Args>(args)...);
+    }
+
+    size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return map.size();
+    }
+
+    // Run f with shared access to the underlying map, to combine several searches
+    template<typename F>
+    auto read(F &&f) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return f(static_cast<Map const &>(map));
+    }
+
+    // Run f with exclusive access to the underlying map, to combine several modifications
+    template<typename F>
+    auto modify(F &&f)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return f(map);
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_CONCURRENT_TOPIC_MAP_H
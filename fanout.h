@@ -0,0 +1,163 @@
+#ifndef MQTTSUBSCRIPTION_FANOUT_H
+#define MQTTSUBSCRIPTION_FANOUT_H
+
+#include <mqtt/subscribe_options.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Stored in a subscriber, one per fan-out thread. Marks whether the subscriber is already
+// part of the current publish of that thread, and where its entry is.
+struct fanout_stamp
+{
+    std::uint64_t generation = 0;
+    std::uint32_t index = 0;
+};
+
+// Collects the subscribers matching a publish, every subscriber once with the highest qos
+// of its matching subscriptions. Subscriber should have a fanout_stamps array with an entry
+// for the slot of this collector. The entries are kept between publishes, so in the steady
+// state collecting does not allocate.
+template<typename Subscriber>
+class fanout_collector
+{
+    struct entry
+    {
+        Subscriber *subscriber;
+        MQTT_NS::qos qos;
+    };
+
+    std::vector<entry> entries;
+    std::uint64_t generation;
+    std::size_t slot;
+
+public:
+    explicit fanout_collector(std::size_t _slot)
+            : generation(0), slot(_slot)
+    { }
+
+    // Start collecting the subscribers of a new publish
+    void clear()
+    {
+        entries.clear();
+        ++generation;
+    }
+
+    void add(Subscriber &subscriber, MQTT_NS::qos qos)
+    {
+        fanout_stamp &stamp = subscriber.fanout_stamps[slot];
+        if(stamp.generation == generation) {
+            entry &e = entries[stamp.index];
+            e.qos = std::max(e.qos, qos);
+        } else {
+            stamp.generation = generation;
+            stamp.index = static_cast<std::uint32_t>(entries.size());
+            entries.push_back(entry{ &subscriber, qos });
+        }
+    }
+
+    std::size_t size() const { return entries.size(); }
+
+    // Call visitor(Subscriber &, MQTT_NS::qos) for all collected subscribers
+    template<typename Visitor>
+    void for_each(Visitor &&visitor) const
+    {
+        for(entry const &e: entries)
+            visitor(*e.subscriber, e.qos);
+    }
+};
+
+// Groups the recipients of a publish by the thread of their connection, so the publish is
+// handed to every thread once instead of once per recipient. Subscriber should have the
+// thread_index of its connection and derive from std::enable_shared_from_this, the batches
+// keep the recipients alive until the publish is delivered.
+//
+// A batch handed out is returned once it is delivered, possibly on another thread, and reused
+// for a later publish, so in the steady state batching does not allocate.
+template<typename Subscriber>
+class fanout_batches
+{
+public:
+    typedef std::vector< std::pair<std::shared_ptr<Subscriber>, MQTT_NS::qos> > batch_type;
+
+private:
+    // Delivered batches, kept for their capacity
+    struct spare_batches
+    {
+        std::mutex mutex;
+        std::vector<batch_type> batches;
+        std::size_t limit;
+    };
+
+    std::vector<batch_type> batches;
+    std::shared_ptr<spare_batches> spares;
+
+public:
+    // A batch handed out by flush, returned to the spare batches when destroyed
+    class lease
+    {
+        batch_type batch;
+        std::shared_ptr<spare_batches> spares;
+
+    public:
+        lease(batch_type &&_batch, std::shared_ptr<spare_batches> const &_spares)
+                : batch(std::move(_batch)), spares(_spares)
+        { }
+
+        lease(lease &&) = default;
+        lease &operator=(lease &&) = default;
+
+        ~lease()
+        {
+            if(!spares)
+                return;
+
+            batch.clear();
+            std::lock_guard<std::mutex> lock(spares->mutex);
+            if(spares->batches.size() < spares->limit)
+                spares->batches.push_back(std::move(batch));
+        }
+
+        batch_type const &operator*() const { return batch; }
+        batch_type const *operator->() const { return &batch; }
+    };
+
+    explicit fanout_batches(std::size_t threads)
+            : batches(threads), spares(std::make_shared<spare_batches>())
+    {
+        spares->limit = threads;
+    }
+
+    void add(Subscriber &subscriber, MQTT_NS::qos qos)
+    {
+        batches[subscriber.thread_index].emplace_back(subscriber.shared_from_this(), qos);
+    }
+
+    // Call f(lease &&) for every thread with recipients, and start with empty batches
+    template<typename F>
+    void flush(F &&f)
+    {
+        for(batch_type &batch: batches) {
+            if(batch.empty())
+                continue;
+
+            batch_type recipients;
+            {
+                std::lock_guard<std::mutex> lock(spares->mutex);
+                if(!spares->batches.empty()) {
+                    recipients = std::move(spares->batches.back());
+                    spares->batches.pop_back();
+                }
+            }
+
+            recipients.swap(batch);
+            f(lease(std::move(recipients), spares));
+        }
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_FANOUT_H
@@ -0,0 +1,170 @@
+#ifndef MQTTSUBSCRIPTION_INFLIGHT_WINDOW_H
+#define MQTTSUBSCRIPTION_INFLIGHT_WINDOW_H
+
+#include <mqtt/subscribe_options.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// The QoS 1 and 2 publishes sent to a client which are not acknowledged yet, at most capacity.
+// Packet ids are assigned in sequence, the publish of a packet id is stored in slot
+// (id - 1) % capacity of a ring. The ids wrap around at the largest multiple of the capacity,
+// so consecutive ids always use consecutive slots. The window is full when the slot of the
+// next id is still taken, by the oldest publish which is not acknowledged. Not thread safe,
+// used on the thread of the session.
+template<typename Message>
+class inflight_window
+{
+public:
+    typedef std::uint16_t packet_id_type;
+    typedef std::uint64_t tick_type;
+
+    enum class phase : std::uint8_t
+    {
+        free,
+
+        // Waiting for the puback, or the pubrec of a QoS 2 publish
+        publish,
+
+        // The pubrec is received and the pubrel sent, waiting for the pubcomp
+        release
+    };
+
+    struct entry
+    {
+        std::shared_ptr<Message const> message;
+        MQTT_NS::qos qos = MQTT_NS::qos::at_most_once;
+        phase state = phase::free;
+        packet_id_type packet_id = 0;
+
+        // When the publish or pubrel was last sent
+        tick_type sent = 0;
+    };
+
+private:
+    std::vector<entry> slots;
+    packet_id_type last_id;
+    packet_id_type next_id;
+
+    // The oldest packet id in use, next_id when the window is empty
+    packet_id_type oldest_id;
+    std::size_t count;
+
+    std::size_t slot(packet_id_type id) const { return (id - 1) % slots.size(); }
+    packet_id_type following(packet_id_type id) const { return id == last_id ? 1 : id + 1; }
+
+    entry *find(packet_id_type id)
+    {
+        if(id == 0)
+            return nullptr;
+        entry &e = slots[slot(id)];
+        return e.state != phase::free && e.packet_id == id ? &e : nullptr;
+    }
+
+public:
+    // Throws when capacity is not between 1 and 65535
+    explicit inflight_window(std::size_t capacity)
+            : last_id(0), next_id(1), oldest_id(1), count(0)
+    {
+        if(capacity == 0 || capacity > std::numeric_limits<packet_id_type>::max())
+            throw std::runtime_error("The in-flight window must be between 1 and 65535 publishes");
+
+        slots.resize(capacity);
+        last_id = packet_id_type(capacity * (std::numeric_limits<packet_id_type>::max() / capacity));
+    }
+
+    bool full() const { return slots[slot(next_id)].state != phase::free; }
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+    std::size_t capacity() const { return slots.size(); }
+
+    // Add a publish sent at now, returns its packet id. The window must not be full
+    packet_id_type add(std::shared_ptr<Message const> const &message, MQTT_NS::qos qos, tick_type now)
+    {
+        packet_id_type id = next_id;
+        next_id = following(next_id);
+
+        slots[slot(id)] = entry{ message, qos, phase::publish, id, now };
+        ++count;
+        return id;
+    }
+
+    // The pubrec of a QoS 2 publish is received at now, returns false for an unknown packet id
+    bool received(packet_id_type id, tick_type now)
+    {
+        entry *e = find(id);
+        if(e == nullptr || e->qos != MQTT_NS::qos::exactly_once)
+            return false;
+
+        e->state = phase::release;
+        e->sent = now;
+        return true;
+    }
+
+    // The puback or pubcomp is received and the packet id is free again, returns false for
+    // an unknown packet id
+    bool acknowledge(packet_id_type id)
+    {
+        entry *e = find(id);
+        if(e == nullptr)
+            return false;
+
+        *e = entry();
+        --count;
+
+        while(oldest_id != next_id && slots[slot(oldest_id)].state == phase::free)
+            oldest_id = following(oldest_id);
+        return true;
+    }
+
+    // Call f(entry &) for the publishes in the window, oldest first
+    template<typename F>
+    void for_each(F &&f)
+    {
+        for(packet_id_type id = oldest_id; id != next_id; id = following(id)) {
+            entry &e = slots[slot(id)];
+            if(e.state != phase::free)
+                f(e);
+        }
+    }
+
+    // Call f(entry &) for the publishes sent at least interval ticks before now, oldest first,
+    // and mark them as sent at now. Returns the number of publishes
+    template<typename F>
+    std::size_t expire(tick_type now, tick_type interval, F &&f)
+    {
+        std::size_t result = 0;
+        for_each([&](entry &e) {
+            if(e.sent + interval <= now) {
+                e.sent = now;
+                f(e);
+                ++result;
+            }
+        });
+        return result;
+    }
+
+    // The tick at which the first publish expires, the window must not be empty
+    tick_type next_expiry(tick_type interval)
+    {
+        tick_type result = std::numeric_limits<tick_type>::max();
+        for_each([&](entry &e) {
+            result = std::min(result, e.sent + interval);
+        });
+        return result;
+    }
+
+    void clear()
+    {
+        for(auto &e: slots)
+            e = entry();
+        count = 0;
+        oldest_id = next_id;
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_INFLIGHT_WINDOW_H
@@ -0,0 +1,101 @@
+#ifndef MQTTSUBSCRIPTION_IO_CONTEXT_POOL_H
+#define MQTTSUBSCRIPTION_IO_CONTEXT_POOL_H
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// A pool of io_contexts, each run by a single thread. Connections are spread over the
+// io_contexts round robin, all handlers of a connection run on the thread of its io_context.
+class io_context_pool
+{
+    typedef boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard_type;
+
+    std::vector< std::unique_ptr<boost::asio::io_context> > io_contexts;
+    std::vector< work_guard_type > work_guards;
+    std::atomic<std::size_t> next_io_context;
+
+    struct thread_info
+    {
+        boost::asio::io_context *ioc = nullptr;
+        std::size_t index = 0;
+    };
+
+    static thread_info &current()
+    {
+        static thread_local thread_info info;
+        return info;
+    }
+
+public:
+    explicit io_context_pool(std::size_t size)
+            : next_io_context(0)
+    {
+        if(size == 0)
+            throw std::runtime_error("io_context_pool size should be at least 1");
+
+        for(std::size_t i = 0; i < size; ++i) {
+            io_contexts.emplace_back(new boost::asio::io_context(1));
+            work_guards.emplace_back(io_contexts.back()->get_executor());
+        }
+    }
+
+    std::size_t size() const { return io_contexts.size(); }
+
+    // Return the next io_context to use for a connection
+    boost::asio::io_context &get_io_context()
+    {
+        return *io_contexts[next_io_context++ % io_contexts.size()];
+    }
+
+    boost::asio::io_context &get_io_context(std::size_t index)
+    {
+        return *io_contexts[index];
+    }
+
+    // Return the io_context run by the calling thread, nullptr when called from outside the pool
+    static boost::asio::io_context *current_io_context()
+    {
+        return current().ioc;
+    }
+
+    // Return the index of the io_context run by the calling thread, 0 when called from outside the pool
+    static std::size_t current_index()
+    {
+        return current().index;
+    }
+
+    // Run all io_contexts, the calling thread runs the first one. Returns when all io_contexts are stopped
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for(std::size_t i = 1; i < io_contexts.size(); ++i) {
+            boost::asio::io_context *ioc = io_contexts[i].get();
+            threads.emplace_back([ioc, i] {
+                current().ioc = ioc;
+                current().index = i;
+                ioc->run();
+            });
+        }
+
+        current().ioc = io_contexts[0].get();
+        current().index = 0;
+        io_contexts[0]->run();
+
+        for(auto &t: threads)
+            t.join();
+    }
+
+    void stop()
+    {
+        work_guards.clear();
+        for(auto &ioc: io_contexts)
+            ioc->stop();
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_IO_CONTEXT_POOL_H
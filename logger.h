@@ -0,0 +1,274 @@
+#ifndef MQTTSUBSCRIPTION_LOGGER_H
+#define MQTTSUBSCRIPTION_LOGGER_H
+
+#include <mqtt/string_view.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class log_level : int
+{
+    trace = 0,
+    debug = 1,
+    info = 2,
+    warning = 3,
+    error = 4,
+    none = 5
+};
+
+// Messages below this level are removed at compile time
+#ifndef MQTTSUBSCRIPTION_LOG_MIN_LEVEL
+#define MQTTSUBSCRIPTION_LOG_MIN_LEVEL 0
+#endif
+
+static inline char const *log_level_name(log_level level)
+{
+    switch(level) {
+        case log_level::trace: return "trace";
+        case log_level::debug: return "debug";
+        case log_level::info: return "info";
+        case log_level::warning: return "warning";
+        case log_level::error: return "error";
+        default: return "none";
+    }
+}
+
+static inline log_level log_level_from_name(MQTT_NS::string_view const &name)
+{
+    for(int i = int(log_level::trace); i <= int(log_level::none); ++i)
+        if(name == log_level_name(log_level(i)))
+            return log_level(i);
+    throw std::runtime_error(std::string("Unknown log level: ").append(name.data(), name.size()));
+}
+
+// Asynchronous logger. Every thread formats its messages into its own single producer /
+// single consumer ring, a background thread writes the rings to the output. Logging never
+// blocks the calling thread, when a ring is full the message is dropped and counted. The ring
+// of a thread is removed once the thread exited and its messages are written.
+class logger
+{
+    class ring
+    {
+        std::vector<std::string> slots;
+        std::atomic<size_t> head;
+        std::atomic<size_t> tail;
+        std::atomic<bool> closed_;
+
+    public:
+        explicit ring(size_t capacity)
+                : slots(capacity), head(0), tail(0), closed_(false)
+        { }
+
+        // Called when the producing thread exits, no message is pushed afterwards
+        void close() { closed_.store(true, std::memory_order_release); }
+        bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+        bool push(std::string &&message)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if(t - head.load(std::memory_order_acquire) == slots.size())
+                return false;
+
+            slots[t % slots.size()] = std::move(message);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(std::string &message)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            if(h == tail.load(std::memory_order_acquire))
+                return false;
+
+            message = std::move(slots[h % slots.size()]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+    };
+
+    enum { ring_capacity = 4096 };
+
+    std::atomic<log_level> level;
+    std::atomic<size_t> dropped;
+    std::atomic<bool> stopping;
+
+    std::mutex rings_mutex;
+    std::vector< std::shared_ptr<ring> > rings;
+
+    std::ostream &output;
+    std::thread writer;
+
+    // Closes the ring of a thread when the thread exits
+    struct thread_registration
+    {
+        std::shared_ptr<ring> r;
+
+        ~thread_registration()
+        {
+            if(r)
+                r->close();
+        }
+    };
+
+    ring &thread_ring()
+    {
+        static thread_local thread_registration registration;
+        if(!registration.r) {
+            registration.r = std::make_shared<ring>(ring_capacity);
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.push_back(registration.r);
+        }
+        return *registration.r;
+    }
+
+    // Write all pending messages, returns the number of messages written
+    size_t drain()
+    {
+        std::vector< std::shared_ptr<ring> > current;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            current = rings;
+        }
+
+        size_t written = 0;
+        std::string message;
+        std::vector<ring const *> finished;
+        for(auto const &r: current) {
+            // A ring closed before it is emptied gets no more messages afterwards
+            bool closed = r->closed();
+            while(r->pop(message)) {
+                output << message << '\n';
+                ++written;
+            }
+            if(closed)
+                finished.push_back(r.get());
+        }
+
+        if(!finished.empty()) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.erase(std::remove_if(rings.begin(), rings.end(), [&finished](std::shared_ptr<ring> const &r) {
+                return std::find(finished.begin(), finished.end(), r.get()) != finished.end();
+            }), rings.end());
+        }
+
+        size_t d = dropped.exchange(0, std::memory_order_relaxed);
+        if(d != 0)
+            output << "[warning] " << d << " log messages dropped" << '\n';
+
+        if(written != 0 || d != 0)
+            output.flush();
+
+        return written;
+    }
+
+    void run()
+    {
+        while(!stopping.load(std::memory_order_acquire)) {
+            if(drain() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        drain();
+    }
+
+    explicit logger(std::ostream &_output)
+            : level(log_level::info), dropped(0), stopping(false), output(_output)
+    {
+        writer = std::thread([this] { run(); });
+    }
+
+public:
+    // A single log message, formatted on the calling thread and queued when destroyed
+    class record
+    {
+        // The streams of the records of a thread, a message may log while it is formatted, so
+        // every nested record uses the next stream
+        struct thread_streams
+        {
+            std::vector< std::unique_ptr<std::ostringstream> > streams;
+            size_t depth = 0;
+        };
+
+        logger &owner;
+        thread_streams &streams_;
+        std::ostringstream &stream_;
+
+        static thread_streams &local_streams()
+        {
+            static thread_local thread_streams s;
+            return s;
+        }
+
+        static std::ostringstream &next_stream(thread_streams &s)
+        {
+            if(s.depth == s.streams.size())
+                s.streams.push_back(std::make_unique<std::ostringstream>());
+
+            std::ostringstream &result = *s.streams[s.depth++];
+            result.str(std::string());
+            result.clear();
+            return result;
+        }
+
+    public:
+        record(logger &_owner, log_level _level)
+                : owner(_owner), streams_(local_streams()), stream_(next_stream(streams_))
+        {
+            stream_ << '[' << log_level_name(_level) << "] ";
+        }
+
+        ~record()
+        {
+            owner.write(stream_.str());
+            --streams_.depth;
+        }
+
+        record(record const &) = delete;
+        record &operator=(record const &) = delete;
+
+        std::ostream &stream() { return stream_; }
+    };
+
+    ~logger()
+    {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+    }
+
+    static logger &instance()
+    {
+        static logger l(std::cout);
+        return l;
+    }
+
+    bool enabled(log_level l) const { return l >= level.load(std::memory_order_relaxed); }
+
+    void set_level(log_level l) { level.store(l, std::memory_order_relaxed); }
+
+    void write(std::string &&message)
+    {
+        if(!thread_ring().push(std::move(message)))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Log a message, the arguments are only evaluated when the level is enabled:
+// BROKER_LOG(info, "client_id: " << client_id);
+#define BROKER_LOG(level, message) \
+    do { \
+        if(int(log_level::level) >= MQTTSUBSCRIPTION_LOG_MIN_LEVEL && logger::instance().enabled(log_level::level)) { \
+            logger::record log_record_(logger::instance(), log_level::level); \
+            log_record_.stream() << message; \
+        } \
+    } while(0)
+
+#endif //MQTTSUBSCRIPTION_LOGGER_H
@@ -2,146 +2,556 @@
 
 #include <string>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "mqtt_server_cpp.hpp"
 #include "subscription_map.h"
 #include "retained_topic_map.h"
-
-using con_t = MQTT_NS::server<>::endpoint_t;
-using con_sp_t = std::shared_ptr<con_t>;
-
-struct session_t
+#include "concurrent_topic_map.h"
+#include "io_context_pool.h"
+#include "session.h"
+#include "retained_replay.h"
+#include "broker_options.h"
+#include "logger.h"
+#include "match_cache.h"
+#include "shared_subscription.h"
+#include "retained_store.h"
+#include "metrics.h"
+
+// The sessions of all clients by client id, of connected clients and the persistent sessions of
+// disconnected clients. Clients without a client id have a clean session and are only counted
+class session_set_t
 {
-    MQTT_NS::buffer client_id;
-    std::weak_ptr<con_t> con;
+    struct client_id_hash
+    {
+        std::size_t operator()(MQTT_NS::buffer const &client_id) const { return boost::hash_range(client_id.begin(), client_id.end()); }
+    };
 
-    using session_subs_t = std::map< MQTT_NS::buffer, MQTT_NS::qos >;
-    session_subs_t subscriptions;
+    struct entry
+    {
+        session_ptr_t session;
+        bool connected;
+    };
+
+    mutable std::mutex mutex;
+    boost::unordered_map< MQTT_NS::buffer, entry, client_id_hash > index;
+    std::size_t connected = 0;
+
+public:
+    // Add the session of a new connection, returns the session of the same client id it takes
+    // over, connected or not
+    session_ptr_t connect(session_ptr_t const &session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(session->client_id.empty()) {
+            ++connected;
+            return session_ptr_t();
+        }
 
-    session_t(const std::weak_ptr<con_t> &con)
-        : con(con)
-    { }
+        auto i = index.try_emplace(session->client_id, entry{ session, true });
+        if(i.second) {
+            ++connected;
+            return session_ptr_t();
+        }
 
-    ~session_t()
-    {
-        std::cout << "Release session: " << client_id << std::endl;
+        if(!i.first->second.connected)
+            ++connected;
+
+        session_ptr_t previous = std::move(i.first->second.session);
+        i.first->second = entry{ session, true };
+        return previous;
     }
 
-    std::shared_ptr<con_t> get_connection()
+    // The connection of session closed, a persistent session is kept. Nothing changes when the
+    // session was taken over meanwhile
+    void disconnect(session_ptr_t const &session, bool persistent)
     {
-        auto sp = con.lock();
-        BOOST_ASSERT(sp);
-        return sp;
+        std::lock_guard<std::mutex> lock(mutex);
+        if(session->client_id.empty()) {
+            --connected;
+            return;
+        }
+
+        auto i = index.find(session->client_id);
+        if(i == index.end() || i->second.session != session || !i->second.connected)
+            return;
+
+        --connected;
+        if(persistent)
+            i->second.connected = false;
+        else
+            index.erase(i);
     }
 
-    void add_subscription(MQTT_NS::buffer topic, MQTT_NS::qos qos)
+    // Connected clients
+    size_t size() const
     {
-        subscriptions[topic] = qos;
+        std::lock_guard<std::mutex> lock(mutex);
+        return connected;
     }
 
-    void remove_subscription(MQTT_NS::buffer topic)
+    // Connected clients and persistent sessions
+    size_t session_count() const
     {
-        auto j = subscriptions.find(topic);
-        if (j != subscriptions.end())
-            subscriptions.erase(j);
+        std::lock_guard<std::mutex> lock(mutex);
+        return index.size();
     }
 
-    std::optional<MQTT_NS::qos> get_subscription(MQTT_NS::buffer topic) const
+    // Call f(session_t const &) for the sessions with a client id, while the set is locked
+    template<typename F>
+    void for_each(F &&f) const
     {
-        auto j = subscriptions.find(topic);
-        if (j != subscriptions.end())
-            return std::make_optional(j->second);
-        else
-            return std::optional<MQTT_NS::qos>();
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto const &i: index)
+            f(*i.second.session);
     }
+};
+
+using subscriber_cache_t = match_cache< topic_generations::stamp, std::pair<session_t *, MQTT_NS::qos> >;
+
+// The subscribers of recent publish topics, one cache per io_context thread
+inline subscriber_cache_t &thread_subscriber_cache(std::size_t capacity)
+{
+    static thread_local subscriber_cache_t cache(capacity);
+    return cache;
+}
+
+// Send a publish to the matching subscriptions, with at most qos. The recipients are collected
+// while the maps are locked, and the message is handed to the thread of each recipient after
+// the locks are released
+inline void publish_to_subscribers(subscription_map_t &subs_map, shared_subscription_map_t &shared_map, broker_options const &options,
+                                   std::size_t threads, MQTT_NS::buffer const &topic_name, MQTT_NS::buffer const &contents, MQTT_NS::qos qos)
+{
+    static thread_local fanout_batches<session_t> batches(threads);
+    auto &metrics = thread_publish_metrics();
+    std::size_t recipients = 0;
+
+    subs_map.read([&topic_name, qos, &options, &metrics, &recipients](auto const &map) {
+        auto const &subscribers = thread_subscriber_cache(options.match_cache_size).find(
+                topic_name, map.stamp(topic_name), [&map, &topic_name, &metrics](auto &entries) {
+            static thread_local fanout_collector<session_t> collector(io_context_pool::current_index());
+            collector.clear();
+
+            auto start = std::chrono::steady_clock::now();
+            map.find(topic_name, []( std::pair<session_ptr_t, MQTT_NS::qos> const &r){
+                collector.add(*r.first, r.second);
+            });
+            metrics.find_latency.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+            collector.for_each([&entries](session_t &subscriber, MQTT_NS::qos qos) {
+                entries.emplace_back(&subscriber, qos);
+            });
+        });
+
+        BROKER_LOG(trace, "Subscribers found: " << subscribers.size());
+        for(auto const &s: subscribers)
+            batches.add(*s.first, std::min(s.second, qos));
+        recipients += subscribers.size();
+    });
+
+    // One member of every matching shared subscription group receives the publish
+    shared_map.read([&topic_name, qos, &options, &recipients](auto const &map) {
+        map.find(topic_name, [qos, &options, &recipients](auto const &group) {
+            auto const &member = group.select(options.shared_delivery_mode, [](std::pair<session_ptr_t, MQTT_NS::qos> const &m) {
+                return m.first->queued_messages.load(std::memory_order_relaxed);
+            });
+            batches.add(*member.first, std::min(member.second, qos));
+            ++recipients;
+        });
+    });
+
+    metrics.fanout.add(recipients);
+
+    // Shared by all recipients
+    auto message = std::make_shared<outgoing_publish const>(outgoing_publish{ topic_name, contents });
+    batches.flush([&message](auto &&recipients) {
+        deliver(std::move(recipients), message);
+    });
+}
 
-    void publish(MQTT_NS::buffer topic_name, MQTT_NS::buffer contents, MQTT_NS::publish_options options) {
-        auto sp = con.lock();
-        if(sp) {
-            sp->publish(
-                    boost::asio::buffer(topic_name),
-                    boost::asio::buffer(contents),
-                    std::make_pair(topic_name, contents), options);
+// Log the statistics of the subscriber cache and of the outbound queues of the thread running timer once a minute
+inline void log_thread_statistics(std::shared_ptr<boost::asio::steady_timer> const &timer, std::size_t thread, std::size_t capacity)
+{
+    timer->expires_after(std::chrono::minutes(1));
+    timer->async_wait([timer, thread, capacity](MQTT_NS::error_code ec) {
+        if(ec)
+            return;
+
+        if(capacity != 0) {
+            auto const &stats = thread_subscriber_cache(capacity).statistics();
+            auto lookups = stats.hits + stats.misses + stats.stale;
+            BROKER_LOG(info, "Subscriber cache of thread " << thread << ": hits " << stats.hits << ", misses " << stats.misses
+                    << ", stale " << stats.stale << ", evictions " << stats.evictions
+                    << ", hit rate " << (lookups == 0 ? 0 : 100 * stats.hits / lookups) << "%");
         }
+
+        auto const &outbound = thread_outbound_statistics();
+        BROKER_LOG(info, "Write batches of thread " << thread << ": batches " << outbound.batches << ", messages " << outbound.messages
+                << ", bytes " << outbound.bytes << ", messages per batch 1/2/4/.../128+: "
+                << outbound.histogram[0] << "/" << outbound.histogram[1] << "/" << outbound.histogram[2] << "/" << outbound.histogram[3] << "/"
+                << outbound.histogram[4] << "/" << outbound.histogram[5] << "/" << outbound.histogram[6] << "/" << outbound.histogram[7]);
+        BROKER_LOG(info, "Outbound queues of thread " << thread << ": queued " << outbound.queued_messages << " publishes, "
+                << outbound.queued_bytes << " bytes, max " << outbound.max_queued_bytes << " bytes, dropped oldest "
+                << outbound.dropped_oldest << ", dropped newest " << outbound.dropped_newest
+                << ", disconnects " << outbound.disconnects << ", dropped offline " << outbound.dropped_offline);
+        BROKER_LOG(info, "In-flight windows of thread " << thread << ": retransmits " << outbound.retransmits
+                << ", batches held back by a full window " << outbound.window_full);
+
+        log_thread_statistics(timer, thread, capacity);
+    });
+}
+
+// Take a snapshot of the metrics every interval. Every thread adds its counters to the snapshot
+// on its own thread, the last one adds the sizes of the maps and sessions, publishes the snapshot
+// on the $SYS topics and writes the Prometheus file
+inline void run_metrics(std::shared_ptr<boost::asio::steady_timer> const &timer, io_context_pool &pool, subscription_map_t &subs_map,
+                        shared_subscription_map_t &shared_map, retained_map_t &retained_map, session_set_t const &sessions,
+                        broker_options const &options)
+{
+    timer->expires_after(options.metrics_interval);
+    timer->async_wait([timer, &pool, &subs_map, &shared_map, &retained_map, &sessions, &options](MQTT_NS::error_code ec) {
+        if(ec)
+            return;
+
+        struct collection
+        {
+            std::mutex mutex;
+            metrics_snapshot snapshot;
+            std::atomic<std::size_t> remaining;
+        };
+
+        auto c = std::make_shared<collection>();
+        c->remaining = pool.size();
+
+        for(std::size_t i = 0; i < pool.size(); ++i) {
+            boost::asio::post(pool.get_io_context(i), [c, threads = pool.size(), &subs_map, &shared_map, &retained_map, &sessions, &options] {
+                {
+                    std::lock_guard<std::mutex> lock(c->mutex);
+                    auto &snapshot = c->snapshot;
+                    snapshot.publishes.merge(thread_publish_metrics());
+
+                    auto const &outbound = thread_outbound_statistics();
+                    snapshot.messages_out += outbound.messages;
+                    snapshot.bytes_out += outbound.bytes;
+                    snapshot.dropped += outbound.dropped_oldest + outbound.dropped_newest + outbound.dropped_offline;
+                    snapshot.retransmits += outbound.retransmits;
+                    snapshot.queued_messages += outbound.queued_messages;
+                    snapshot.queued_bytes += outbound.queued_bytes;
+                }
+
+                if(--c->remaining != 0)
+                    return;
+
+                auto &snapshot = c->snapshot;
+                snapshot.connected_clients = sessions.size();
+                snapshot.sessions = sessions.session_count();
+                sessions.for_each([&snapshot](session_t const &session) {
+                    snapshot.session_queue_depth.add(session.queued_messages.load(std::memory_order_relaxed));
+                });
+                snapshot.subscription_nodes = subs_map.size();
+                snapshot.shared_subscription_groups = shared_map.size();
+                snapshot.retained_messages = retained_map.read([](auto const &map) { return map.values(); });
+
+                snapshot.for_each_sys_topic([&](std::string const &topic, std::string const &payload) {
+                    publish_to_subscribers(subs_map, shared_map, options, threads, MQTT_NS::allocate_buffer(topic),
+                                           MQTT_NS::allocate_buffer(payload), MQTT_NS::qos::at_most_once);
+                });
+
+                if(!options.metrics_file.empty()) {
+                    try {
+                        snapshot.write_prometheus_file(options.metrics_file);
+                    } catch(std::exception &e) {
+                        BROKER_LOG(error, "Failed to write the metrics: " << e.what());
+                    }
+                }
+            });
+        }
+
+        run_metrics(timer, pool, subs_map, shared_map, retained_map, sessions, options);
+    });
+}
+
+// Remove the subscriptions of a session
+inline void discard_session(subscription_map_t &subs_map, shared_subscription_map_t &shared_map, session_ptr_t const &session) {
+    subs_map.modify([&session](auto &map) {
+        for(auto const &i: session->subscriptions)
+            map.remove(i.first, i.second.handle);
+    });
+    session->subscriptions.clear();
+
+    if(!session->shared_subscriptions.empty()) {
+        shared_map.modify([&session](auto &map) {
+            for(auto const &i: session->shared_subscriptions)
+                map.remove(i.second.handle);
+        });
+        session->shared_subscriptions.clear();
     }
-};
+}
+
+// Remove the subscriptions of a closed session, or keep them when the session is persistent.
+// Can be called more than once
+inline void close_session(subscription_map_t &subs_map, shared_subscription_map_t &shared_map, session_set_t &sessions, session_ptr_t const &session) {
+    if(session->closed)
+        return;
+
+    session->closed = true;
+    session->connected = false;
+    session->stop_keep_alive();
+    session->stop_retransmit();
+
+    // Not added to the sessions before the client connected
+    if(session->ioc != nullptr)
+        sessions.disconnect(session, !session->clean_session);
+
+    if(!session->clean_session) {
+        session->suspend();
+        BROKER_LOG(debug, "Session suspended: " << session->client_id << ", active sessions: " << sessions.size() << ", sessions: " << sessions.session_count());
+        return;
+    }
+
+    session->drop_outbound();
+    discard_session(subs_map, shared_map, session);
+    BROKER_LOG(debug, "Active sessions: " << sessions.size());
+}
 
-using session_ptr_t = std::shared_ptr<session_t>;
-using session_weak_ptr_t = std::weak_ptr<session_t>;
+// Take over the session previous of a client which connected again with session. When the client
+// is still connected through previous, that connection is closed. The state of previous is taken on
+// its thread, after which previous forwards its publishes to session. When both sessions are
+// persistent, the subscriptions are pointed at session without searching the maps, and the connack
+// is sent once session has the state. Otherwise the state of previous is discarded.
+inline void take_over_session(subscription_map_t &subs_map, shared_subscription_map_t &shared_map, session_ptr_t const &previous,
+                              session_ptr_t const &session) {
+    boost::asio::post(*previous->ioc, [&subs_map, &shared_map, previous, session] {
+        if(!previous->closed) {
+            BROKER_LOG(info, "Session taken over: " << previous->client_id);
+            previous->closed = true;
+            previous->connected = false;
+            previous->stop_keep_alive();
+            previous->stop_retransmit();
+            previous->suspend();
+            if(auto sp = previous->con.lock())
+                sp->async_force_disconnect();
+        }
 
-using subscription_map_t = multiple_subscription_map<std::pair<session_ptr_t, MQTT_NS::qos>, std::deque>;
+        if(previous->clean_session || session->clean_session) {
+            previous->offline.clear();
+            previous->inflight.clear();
+            discard_session(subs_map, shared_map, previous);
+            if(!session->clean_session) {
+                boost::asio::post(*session->ioc, [session] {
+                    if(!session->closed)
+                        session->accept();
+                });
+            }
+            return;
+        }
 
-inline void close_session(subscription_map_t &subs_map, std::set<session_ptr_t> &sessions, session_ptr_t const &session) {
-    for(auto const &i: session->subscriptions)
-        subs_map.remove(i.first, std::make_pair(session, i.second));
+        previous->successor = session;
+
+        struct session_state
+        {
+            session_t::session_subs_t subscriptions;
+            session_t::shared_subs_t shared_subscriptions;
+            offline_queue<outgoing_publish> offline;
+            inflight_window_t inflight;
+        };
+
+        // The window of previous is replaced, acknowledgements still arriving on its connection are ignored
+        auto state = std::make_shared<session_state>(session_state{
+            std::move(previous->subscriptions), std::move(previous->shared_subscriptions), std::move(previous->offline),
+            std::exchange(previous->inflight, inflight_window_t(previous->inflight.capacity())) });
+        previous->subscriptions.clear();
+        previous->shared_subscriptions.clear();
+
+        boost::asio::post(*session->ioc, [&subs_map, &shared_map, session, state] {
+            // Subscriptions the client made since it connected replace those of the previous session
+            subs_map.modify([&state, &session](auto &map) {
+                for(auto const &i: state->subscriptions) {
+                    if(session->subscriptions.count(i.first) != 0) {
+                        map.remove(i.first, i.second.handle);
+                    } else {
+                        map.replace(i.first, i.second.handle, std::make_pair(session, i.second.qos));
+                        session->subscriptions.emplace(i.first, i.second);
+                    }
+                }
+            });
+
+            if(!state->shared_subscriptions.empty()) {
+                shared_map.modify([&state, &session](auto &map) {
+                    for(auto const &i: state->shared_subscriptions) {
+                        if(session->shared_subscriptions.count(i.first) != 0) {
+                            map.remove(i.second.handle);
+                        } else {
+                            map.replace(i.second.handle, std::make_pair(session, i.second.qos));
+                            session->shared_subscriptions.emplace(i.first, i.second);
+                        }
+                    }
+                });
+            }
 
-    sessions.erase(session);
-    std::cout << "Active sessions: " << sessions.size() << std::endl;
+            BROKER_LOG(debug, "Session resumed: " << session->client_id << ", offline publishes: " << state->offline.size()
+                    << ", in-flight publishes: " << state->inflight.size());
+            session->resume(std::move(state->offline), std::move(state->inflight));
+        });
+    });
+}
+
+// Advance the session timers of the thread running timer every tick. Close the sessions of which
+// the keep-alive expired, and send the unacknowledged publishes of sessions again
+inline void run_session_timers(std::shared_ptr<boost::asio::steady_timer> const &timer, subscription_map_t &subs_map,
+                           shared_subscription_map_t &shared_map, session_set_t &sessions)
+{
+    timer->expires_after(keep_alive_tick);
+    timer->async_wait([timer, &subs_map, &shared_map, &sessions](MQTT_NS::error_code ec) {
+        if(ec)
+            return;
+
+        thread_keep_alive_wheel().advance(keep_alive_now(), [&subs_map, &shared_map, &sessions](session_t &expired) {
+            BROKER_LOG(info, "Keep-alive expired: " << expired.client_id);
+
+            session_ptr_t session = expired.shared_from_this();
+            close_session(subs_map, shared_map, sessions, session);
+            if(auto sp = session->con.lock())
+                sp->async_force_disconnect();
+        });
+
+        thread_retransmit_wheel().advance(keep_alive_now(), [](session_t &expired) {
+            expired.retransmit();
+        });
+
+        run_session_timers(timer, subs_map, shared_map, sessions);
+    });
 }
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cout << argv[0] << " port" << std::endl;
+    broker_options options;
+    try {
+        options = broker_options::parse(argc, argv);
+    } catch(std::exception &e) {
+        std::cout << e.what() << std::endl;
+        broker_options::usage(argv[0]);
         return -1;
     }
-    boost::asio::io_context ioc;
 
-    auto server_endpoint = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),boost::lexical_cast<std::uint16_t>(argv[1]));
-    auto s = MQTT_NS::server<>(server_endpoint, ioc);
+    logger::instance().set_level(options.level);
+
+    // One io_context per thread, the first one also accepts the connections
+    io_context_pool pool(options.threads);
+
+    auto server_endpoint = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), options.port);
+    auto s = MQTT_NS::server<>(
+            server_endpoint,
+            pool.get_io_context(0),
+            [&pool]() -> boost::asio::io_context & { return pool.get_io_context(); });
 
     s.set_error_handler(
             [](MQTT_NS::error_code ec) {
-                std::cout << "error: " << ec.message() << std::endl;
+                BROKER_LOG(error, "error: " << ec.message());
             }
     );
 
     subscription_map_t subs_map;
-    retained_topic_map<MQTT_NS::buffer> retained_map;
+    shared_subscription_map_t shared_map;
+    retained_map_t retained_map;
+
+    // Declared after the retained map, its writer thread compacts the map until it is destroyed
+    std::unique_ptr<retained_store> store;
+    if(!options.retained_store.empty()) {
+        try {
+            store = std::make_unique<retained_store>(options.retained_store, options.retained_sync_interval, options.retained_compact_bytes);
+            store->load(retained_map);
+            store->start(retained_map);
+        } catch(std::exception &e) {
+            BROKER_LOG(error, "Failed to load the retained store: " << e.what());
+            return -1;
+        }
+    }
+
+    for(std::size_t i = 0; i < pool.size(); ++i)
+        log_thread_statistics(std::make_shared<boost::asio::steady_timer>(pool.get_io_context(i)), i, options.match_cache_size);
+
+    session_set_t sessions;
 
-    std::set<session_ptr_t> sessions;
+    if(options.metrics_interval.count() != 0)
+        run_metrics(std::make_shared<boost::asio::steady_timer>(pool.get_io_context(0)), pool, subs_map, shared_map, retained_map, sessions, options);
+
+    for(std::size_t i = 0; i < pool.size(); ++i)
+        run_session_timers(std::make_shared<boost::asio::steady_timer>(pool.get_io_context(i)), subs_map, shared_map, sessions);
 
     s.set_accept_handler(
-            [&subs_map, &retained_map, &sessions](con_sp_t spep) {
+            [&subs_map, &shared_map, &retained_map, &sessions, &options, store = store.get(), threads = pool.size()](con_sp_t spep) {
                 auto& ep = *spep;
 
-                session_ptr_t session = std::make_shared<session_t>(std::weak_ptr<con_t>(spep));
+                session_ptr_t session = std::make_shared<session_t>(std::weak_ptr<con_t>(spep), threads, options.outbound, options.offline);
 
                 using packet_id_t = typename std::remove_reference_t<decltype(ep)>::packet_id_t;
-                std::cout << "accept" << std::endl;
+                BROKER_LOG(debug, "accept");
 
                 // Pass spep to keep lifetime.
                 // It makes sure wp.lock() never return nullptr in the handlers below
                 // including close_handler and error_handler.
                 ep.start_session(session);
 
+                // Publishes handed to the endpoint while a write is in progress are written together
+                ep.set_bulk_write(true);
+
+                // The pubrel of a QoS 2 publish is sent by the endpoint when the pubrec arrives
+                ep.set_auto_pub_response(true);
+
+                // Every packet received restarts the keep-alive, including PINGREQ
+                ep.set_mqtt_message_processed_handler([session](MQTT_NS::any) {
+                    session->touch();
+                });
+
                 // set connection (lower than MQTT) level handlers
                 ep.set_close_handler(
-                        [&subs_map, &sessions, session]() {
-                            std::cout << "[server] closed session: " << session->client_id << std::endl;
-                            close_session(subs_map, sessions, session);
+                        [&subs_map, &shared_map, &sessions, session]() {
+                            BROKER_LOG(info, "closed session: " << session->client_id);
+                            close_session(subs_map, shared_map, sessions, session);
                         });
 
                 ep.set_error_handler(
-                        [&subs_map, &sessions, session](MQTT_NS::error_code ec) {
-                            std::cout << "[server] error: " << ec.message() << " " << session->client_id << std::endl;
-                            close_session(subs_map, sessions, session);
+                        [&subs_map, &shared_map, &sessions, session](MQTT_NS::error_code ec) {
+                            BROKER_LOG(warning, "error: " << ec.message() << " " << session->client_id);
+                            close_session(subs_map, shared_map, sessions, session);
                         });
 
                 // set MQTT level handlers
                 ep.set_connect_handler(
-                        [&sessions, session](MQTT_NS::buffer client_id, MQTT_NS::optional<MQTT_NS::buffer> username, MQTT_NS::optional<MQTT_NS::buffer> password, MQTT_NS::optional<MQTT_NS::will>, bool clean_session, std::uint16_t keep_alive) {
+                        [&subs_map, &shared_map, &sessions, session](MQTT_NS::buffer client_id, MQTT_NS::optional<MQTT_NS::buffer> username, MQTT_NS::optional<MQTT_NS::buffer> password, MQTT_NS::optional<MQTT_NS::will>, bool clean_session, std::uint16_t keep_alive) {
                             auto sp = session->get_connection();
 
                             using namespace MQTT_NS::literals;
-                            std::cout << "[server] client_id    : " << client_id << std::endl;
-                            std::cout << "[server] username     : " << (username ? username.value() : "none"_mb) << std::endl;
-                            std::cout << "[server] password     : " << (password ? password.value() : "none"_mb) << std::endl;
-                            std::cout << "[server] clean_session: " << std::boolalpha << clean_session << std::endl;
-                            std::cout << "[server] keep_alive   : " << keep_alive << std::endl;
+                            BROKER_LOG(info, "connect client_id: " << client_id
+                                    << " username: " << (username ? username.value() : "none"_mb)
+                                    << " clean_session: " << std::boolalpha << clean_session
+                                    << " keep_alive: " << keep_alive);
+
+                            // A persistent session is identified by its client id
+                            if(client_id.empty() && !clean_session) {
+                                sp->connack(false, MQTT_NS::connect_return_code::identifier_rejected);
+                                return false;
+                            }
 
                             session->client_id = client_id;
-                            sessions.insert(session);
-                            sp->connack(false, MQTT_NS::connect_return_code::accepted);
+                            session->ioc = io_context_pool::current_io_context();
+                            session->thread_index = io_context_pool::current_index();
+                            session->clean_session = clean_session;
+                            session->start_keep_alive(keep_alive);
+
+                            // A client connecting again takes over its previous session
+                            auto previous = sessions.connect(session);
+                            if(previous)
+                                take_over_session(subs_map, shared_map, previous, session);
+
+                            // A resumed session is accepted once it has the state of the previous session
+                            if(clean_session || !previous)
+                                session->accept();
                             return true;
                         }
                 );
@@ -153,70 +563,85 @@ int main(int argc, char** argv) {
                 });
 
                 ep.set_disconnect_handler(
-                        [&subs_map, &sessions, session]() {
+                        [&subs_map, &shared_map, &sessions, session]() {
                             auto sp = session->get_connection();
-                            std::cout << "[server] disconnect received." << std::endl;
-                            close_session(subs_map, sessions, session);
+                            BROKER_LOG(debug, "disconnect received. client_id: " << session->client_id);
+                            close_session(subs_map, shared_map, sessions, session);
                         });
 
                 ep.set_puback_handler(
-                        [](packet_id_t packet_id){
-                            std::cout << "[server] puback received. packet_id: " << packet_id << std::endl;
+                        [session](packet_id_t packet_id){
+                            BROKER_LOG(trace, "puback received. packet_id: " << packet_id);
+                            session->acknowledge(packet_id);
                             return true;
                         });
 
                 ep.set_pubrec_handler(
-                        [](packet_id_t packet_id){
-                            std::cout << "[server] pubrec received. packet_id: " << packet_id << std::endl;
+                        [session](packet_id_t packet_id){
+                            BROKER_LOG(trace, "pubrec received. packet_id: " << packet_id);
+                            session->received(packet_id);
                             return true;
                         });
 
                 ep.set_pubrel_handler(
                         [](packet_id_t packet_id){
-                            std::cout << "[server] pubrel received. packet_id: " << packet_id << std::endl;
+                            BROKER_LOG(trace, "pubrel received. packet_id: " << packet_id);
                             return true;
                         });
 
                 ep.set_pubcomp_handler(
-                        [](packet_id_t packet_id){
-                            std::cout << "[server] pubcomp received. packet_id: " << packet_id << std::endl;
+                        [session](packet_id_t packet_id){
+                            BROKER_LOG(trace, "pubcomp received. packet_id: " << packet_id);
+                            session->acknowledge(packet_id);
                             return true;
                         });
 
                 ep.set_publish_handler(
-                        [&subs_map, &retained_map, session]
+                        [&subs_map, &shared_map, &retained_map, &options, store, threads, session]
                                 (MQTT_NS::optional<packet_id_t> packet_id,
                                  MQTT_NS::publish_options pubopts,
                                  MQTT_NS::buffer topic_name,
                                  MQTT_NS::buffer contents){
-                            std::cout << "[server] publish received."
-                                      << " dup: "    << pubopts.get_dup()
-                                      << " qos: "    << pubopts.get_qos()
-                                      << " retain: " << pubopts.get_retain() << std::endl;
-                            if (packet_id)
-                                std::cout << "[server] packet_id: " << *packet_id << std::endl;
-                            std::cout << "[server] topic_name: " << topic_name << std::endl;
-                            std::cout << "[server] contents: " << contents << std::endl;
-
-                            std::map< session_ptr_t, MQTT_NS::qos > subscribers;
-
-                            if(pubopts.get_retain() == MQTT_NS::retain::yes)
-                                retained_map.insert_or_update(topic_name, contents);
-
-                            subs_map.find(std::string(topic_name.data(), topic_name.size()), [&topic_name, &contents, &pubopts, &subscribers]( std::pair<session_ptr_t, MQTT_NS::qos> const &r){
-                                subscribers[r.first] = std::max(r.second, subscribers[r.first]);
-                            });
+                            BROKER_LOG(trace, "publish received."
+                                    << " dup: "    << pubopts.get_dup()
+                                    << " qos: "    << pubopts.get_qos()
+                                    << " retain: " << pubopts.get_retain()
+                                    << " packet_id: " << (packet_id ? *packet_id : 0)
+                                    << " topic_name: " << topic_name
+                                    << " contents: " << contents);
+
+                            if(pubopts.get_retain() == MQTT_NS::retain::yes) {
+                                // A retained message without contents clears the retained message of the topic.
+                                // The store is appended to under the same lock, in the order of the modifications
+                                retained_map.modify([&topic_name, &contents, &pubopts, store](auto &map) {
+                                    if(contents.empty()) {
+                                        map.remove(topic_name);
+                                        if(store)
+                                            store->remove(topic_name);
+                                    } else {
+                                        map.insert_or_update(topic_name, retained_message{ topic_name, contents, pubopts.get_qos() });
+                                        if(store)
+                                            store->update(topic_name, contents, pubopts.get_qos());
+                                    }
+                                });
+                            }
 
-                            std::cout << "Subscribers found: " << subscribers.size() << std::endl;
-                            for(auto const &r: subscribers)
-                                r.first->publish(topic_name, contents, std::min(r.second, pubopts.get_qos()) |  pubopts.get_retain());
+                            auto &metrics = thread_publish_metrics();
+                            ++metrics.messages_in;
+                            metrics.bytes_in += topic_name.size() + contents.size();
 
+                            publish_to_subscribers(subs_map, shared_map, options, threads, topic_name, contents, pubopts.get_qos());
                             return true;
                         });
 
                 ep.set_subscribe_handler(
-                        [&subs_map, &retained_map, session] (packet_id_t packet_id, std::vector<std::tuple<MQTT_NS::buffer, MQTT_NS::subscribe_options>> entries) {
-                            std::cout << "[server]subscribe received. packet_id: " << packet_id << std::endl;
+                        [&subs_map, &shared_map, &retained_map, &options, session] (packet_id_t packet_id, std::vector<std::tuple<MQTT_NS::buffer, MQTT_NS::subscribe_options>> entries) {
+                            BROKER_LOG(debug, "subscribe received. packet_id: " << packet_id << ", client id: " << session->client_id);
+
+                            // The connection is closing, the session may be taken over already
+                            if(session->closed)
+                                return true;
+
                             std::vector<MQTT_NS::suback_return_code> res;
                             res.reserve(entries.size());
 
@@ -225,32 +650,78 @@ int main(int argc, char** argv) {
                             for (auto const& e : entries) {
                                 MQTT_NS::buffer topic = std::get<0>(e);
                                 MQTT_NS::qos qos_value = std::get<1>(e).get_qos();
-                                std::cout << "[server] topic: " << topic  << " qos: " << qos_value << std::endl;
-
-                                session->add_subscription(topic, qos_value);
-                                subs_map.insert(topic, std::make_pair(session, qos_value));
+                                BROKER_LOG(debug, "topic: " << topic  << " qos: " << qos_value);
+
+                                std::optional<shared_filter> shared;
+                                try {
+                                    shared = parse_shared_filter(topic);
+                                } catch(std::exception &e) {
+                                    BROKER_LOG(warning, e.what() << ": " << topic);
+                                    res.emplace_back(MQTT_NS::suback_return_code::failure);
+                                    continue;
+                                }
+
+                                // A member of a shared subscription group, joining the same group again replaces the membership
+                                if(shared) {
+                                    shared_map.modify([&session, &topic, &shared, qos_value](auto &map) {
+                                        auto j = session->shared_subscriptions.find(topic);
+                                        if(j != session->shared_subscriptions.end())
+                                            map.remove(j->second.handle);
+                                        session->shared_subscriptions[topic] = session_t::shared_subscription{
+                                            qos_value, map.insert(*shared, std::make_pair(session, qos_value)) };
+                                    });
+
+                                    res.emplace_back(MQTT_NS::qos_to_suback_return_code(qos_value));
+                                    continue;
+                                }
+
+                                // A subscription to the same topic filter replaces the existing one
+                                subs_map.modify([&session, &topic, qos_value](auto &map) {
+                                    auto j = session->get_subscription(topic);
+                                    if(j)
+                                        map.remove(topic, j->handle);
+                                    session->add_subscription(topic, qos_value, map.insert(topic, std::make_pair(session, qos_value)));
+                                });
 
                                 res.emplace_back(MQTT_NS::qos_to_suback_return_code(qos_value));
-
-                                retained_map.find(topic, [&session, &topic, qos_value](MQTT_NS::buffer const &content) {
-                                    session->publish(topic, content, qos_value);
-                                });
                             }
 
                             sp->suback(packet_id, res);
+
+                            // The retained messages are sent after the suback, in batches. Not for shared
+                            // subscriptions, nor for rejected topic filters
+                            for (auto const& e : entries) {
+                                if(!session->get_subscription(std::get<0>(e)))
+                                    continue;
+                                retained_replay::start(retained_map, session, std::get<0>(e), std::get<1>(e).get_qos(),
+                                                       options.retained_batch_size, options.retained_max_queued);
+                            }
                             return true;
                         }
                 );
 
-                ep.set_unsubscribe_handler([&subs_map, session](packet_id_t packet_id, std::vector<MQTT_NS::buffer> topics) {
-                            std::cout << "[server]unsubscribe received. packet_id: " << packet_id << ", client id: " << session->client_id << std::endl;
+                ep.set_unsubscribe_handler([&subs_map, &shared_map, session](packet_id_t packet_id, std::vector<MQTT_NS::buffer> topics) {
+                            BROKER_LOG(debug, "unsubscribe received. packet_id: " << packet_id << ", client id: " << session->client_id);
+
+                            if(session->closed)
+                                return true;
+
 
                             auto sp = session->get_connection();
 
                             for (auto const& topic : topics) {
+                                auto shared = session->shared_subscriptions.find(topic);
+                                if(shared != session->shared_subscriptions.end()) {
+                                    shared_map.modify([&shared](auto &map) {
+                                        map.remove(shared->second.handle);
+                                    });
+                                    session->shared_subscriptions.erase(shared);
+                                    continue;
+                                }
+
                                 auto j = session->get_subscription(topic);
                                 if(j)
-                                    subs_map.remove(topic, std::make_pair(session, *j));
+                                    subs_map.remove(topic, j->handle);
                                 session->remove_subscription(topic);
                             }
 
@@ -263,5 +734,5 @@ int main(int argc, char** argv) {
 
     s.listen();
 
-    ioc.run();
+    pool.run();
 }
\ No newline at end of file
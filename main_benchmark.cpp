@@ -0,0 +1,496 @@
+#include "precomp.h"
+
+#include "subscription_map.h"
+#include "subscription_trie.h"
+#include "retained_topic_map.h"
+#include "pool_allocator.h"
+#include "match_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// Count the heap allocations and the live heap bytes of the benchmark. Every allocation
+// has a header holding its size, so the live bytes are known on delete.
+static std::atomic<size_t> allocation_count(0);
+static std::atomic<size_t> allocated_bytes(0);
+
+static constexpr size_t allocation_header = alignof(std::max_align_t);
+
+void *operator new(std::size_t size)
+{
+    ++allocation_count;
+    allocated_bytes += size;
+    if(char *p = static_cast<char *>(std::malloc(size + allocation_header))) {
+        *reinterpret_cast<std::size_t *>(p) = size;
+        return p + allocation_header;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    if(p == nullptr)
+        return;
+    char *block = static_cast<char *>(p) - allocation_header;
+    allocated_bytes -= *reinterpret_cast<std::size_t *>(block);
+    std::free(block);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+struct benchmark_options
+{
+    size_t depth = 6;
+    size_t fanout = 8;
+    size_t subscriptions = 100000;
+    size_t iterations = 100000;
+    size_t churn = 10;
+
+    static benchmark_options parse(int argc, char **argv)
+    {
+        benchmark_options result;
+        for(int i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            auto separator = arg.find('=');
+            if(arg.substr(0, 2) != "--" || separator == std::string::npos)
+                throw std::runtime_error("Unexpected argument: " + arg);
+
+            std::string name = arg.substr(2, separator - 2);
+            size_t value = boost::lexical_cast<size_t>(arg.substr(separator + 1));
+
+            if(name == "depth")
+                result.depth = value;
+            else if(name == "fanout")
+                result.fanout = value;
+            else if(name == "subscriptions")
+                result.subscriptions = value;
+            else if(name == "iterations")
+                result.iterations = value;
+            else if(name == "churn")
+                result.churn = value;
+            else
+                throw std::runtime_error("Unknown option: " + arg);
+        }
+
+        if(result.depth == 0 || result.fanout == 0 || result.subscriptions == 0 || result.iterations == 0)
+            throw std::runtime_error("Options should be at least 1");
+        return result;
+    }
+};
+
+// Generates topics and topic filters in a synthetic tree of depth levels, with fanout
+// children per level
+class topic_generator
+{
+    benchmark_options const &options;
+    std::mt19937 random;
+
+public:
+    explicit topic_generator(benchmark_options const &_options)
+            : options(_options), random(1234)
+    { }
+
+    std::string topic()
+    {
+        std::string result;
+        for(size_t i = 0; i < options.depth; ++i) {
+            if(i != 0)
+                result += '/';
+            result += "l" + std::to_string(random() % options.fanout);
+        }
+        return result;
+    }
+
+    // Replace a random level with '+'
+    std::string plus_filter()
+    {
+        std::string t = topic();
+        std::vector<std::string> levels;
+        for(auto const &l: mqtt_path_tokenizer(t))
+            levels.emplace_back(l.data(), l.size());
+
+        levels[random() % levels.size()] = "+";
+
+        std::string result;
+        for(size_t i = 0; i < levels.size(); ++i)
+            result += (i == 0 ? "" : "/") + levels[i];
+        return result;
+    }
+
+    // Cut the topic at a random level and end it with '#'
+    std::string hash_filter()
+    {
+        std::string t = topic();
+        size_t keep = random() % options.depth;
+        size_t pos = 0;
+        for(size_t i = 0; i < keep; ++i)
+            pos = t.find('/', pos) + 1;
+        return t.substr(0, pos) + "#";
+    }
+
+    // Subscription mix: mostly exact topics, some single level and some multi level wildcards
+    std::string filter()
+    {
+        size_t kind = random() % 100;
+        if(kind < 80)
+            return topic();
+        if(kind < 95)
+            return plus_filter();
+        return hash_filter();
+    }
+};
+
+// Measures a number of operations and prints ns/op and allocations/op
+class measurement
+{
+    std::string name;
+    size_t operations;
+    size_t allocations;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    measurement(std::string const &_name, size_t _operations)
+            : name(_name), operations(_operations), allocations(allocation_count), start(std::chrono::steady_clock::now())
+    { }
+
+    ~measurement()
+    {
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        size_t allocs = allocation_count - allocations;
+
+        std::cout << std::left << std::setw(44) << name << std::right
+                  << std::setw(10) << std::fixed << std::setprecision(1) << ns / operations << " ns/op"
+                  << std::setw(10) << std::setprecision(2) << double(allocs) / operations << " allocs/op" << std::endl;
+    }
+};
+
+// Return the resident set size of the process, it is only read on Linux
+static std::optional<size_t> resident_bytes()
+{
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if(!(statm >> pages >> resident))
+        return std::nullopt;
+    return resident * size_t(sysconf(_SC_PAGESIZE));
+#else
+    return std::nullopt;
+#endif
+}
+
+static void print_footprint(std::string const &name, size_t bytes, size_t entries)
+{
+    std::cout << std::left << std::setw(44) << name << std::right
+              << std::setw(10) << bytes / 1024 << " KiB"
+              << std::setw(10) << std::fixed << std::setprecision(1) << double(bytes) / entries << " bytes/entry" << std::endl;
+}
+
+void BenchmarkFindCallback()
+{
+    enum { subscribers = 1000, iterations = 10000 };
+
+    multiple_subscription_map<int> map;
+    for(int i = 0; i < subscribers; ++i) {
+        map.insert("example/test/A", i);
+        map.insert("example/+/A", i);
+        map.insert("example/#", i);
+    }
+
+    size_t matches = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i)
+        map.find("example/test/A", std::function< void (int const &) >([&matches](int const &) { ++matches; }));
+    double function_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    size_t function_matches = matches;
+    matches = 0;
+
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < iterations; ++i)
+        map.find("example/test/A", [&matches](int const &) { ++matches; });
+    double template_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "find with std::function: " << function_ns / function_matches << " ns/match" << std::endl;
+    std::cout << "find with template:      " << template_ns / matches << " ns/match" << std::endl;
+}
+
+template<typename Map>
+void BenchmarkSubscriptionMap(std::string const &name, benchmark_options const &options)
+{
+    topic_generator generator(options);
+
+    std::vector<std::string> filters;
+    for(size_t i = 0; i < options.subscriptions; ++i)
+        filters.push_back(generator.filter());
+
+    std::vector<std::string> topics;
+    for(size_t i = 0; i < options.iterations; ++i)
+        topics.push_back(generator.topic());
+
+    size_t bytes_before = allocated_bytes;
+    size_t matches = 0;
+    {
+        Map map;
+        {
+            measurement m(name + " insert", filters.size());
+            for(size_t i = 0; i < filters.size(); ++i)
+                map.insert(filters[i], int(i));
+        }
+
+        print_footprint(name + " memory", allocated_bytes - bytes_before, filters.size());
+
+        {
+            measurement m(name + " find", topics.size());
+            for(auto const &t: topics)
+                map.find(t, [&matches](int) { ++matches; });
+        }
+
+        {
+            measurement m(name + " remove", filters.size());
+            for(size_t i = 0; i < filters.size(); ++i)
+                map.remove(filters[i], int(i));
+        }
+    }
+
+    std::cout << name << " matches/find: " << double(matches) / topics.size() << std::endl;
+}
+
+// Subscriptions that are removed and inserted again with another topic filter, like devices
+// which subscribe on every reconnect. Every round replaces all subscriptions once, the heap
+// and resident size afterwards show the fragmentation left by the churn.
+template<typename Map>
+void BenchmarkChurn(std::string const &name, benchmark_options const &options)
+{
+    topic_generator generator(options);
+
+    // Replacement filters are taken from a fixed set, so the churn itself does not allocate
+    std::vector<std::string> candidates;
+    for(size_t i = 0; i < 2 * options.subscriptions; ++i)
+        candidates.push_back(generator.filter());
+
+    std::mt19937 random(42);
+    size_t bytes_before = allocated_bytes;
+    {
+        Map map;
+        std::vector<size_t> filters;
+        std::vector<typename Map::handle> handles;
+        for(size_t i = 0; i < options.subscriptions; ++i) {
+            filters.push_back(i);
+            handles.push_back(map.insert(candidates[i], int(i)));
+        }
+
+        {
+            measurement m(name + " churn remove+insert", options.churn * filters.size());
+            for(size_t round = 0; round < options.churn; ++round) {
+                for(size_t n = 0; n < filters.size(); ++n) {
+                    size_t i = random() % filters.size();
+                    map.remove(candidates[filters[i]], handles[i]);
+                    filters[i] = random() % candidates.size();
+                    handles[i] = map.insert(candidates[filters[i]], int(i));
+                }
+            }
+        }
+
+        print_footprint(name + " churn heap", allocated_bytes - bytes_before, filters.size());
+    }
+
+    auto rss = resident_bytes();
+    std::cout << std::left << std::setw(44) << (name + " churn rss") << std::right << std::setw(10);
+    if(rss)
+        std::cout << *rss / 1024 << " KiB" << std::endl;
+    else
+        std::cout << "unavailable" << std::endl;
+}
+
+void BenchmarkSingleSubscriptionMap(benchmark_options const &options)
+{
+    topic_generator generator(options);
+
+    // Unique subscriptions of each kind, a single map allows one value per filter
+    std::set<std::string> exact, plus, hash;
+    for(size_t i = 0; i < options.subscriptions; ++i) {
+        exact.insert(generator.topic());
+        plus.insert(generator.plus_filter());
+        hash.insert(generator.hash_filter());
+    }
+
+    std::vector<std::string> topics;
+    for(size_t i = 0; i < options.iterations; ++i)
+        topics.push_back(generator.topic());
+
+    auto run = [&topics](std::string const &name, std::set<std::string> const &filters) {
+        single_subscription_map<int> map;
+        {
+            measurement m(name + " insert", filters.size());
+            for(auto const &f: filters)
+                map.insert(f, 0);
+        }
+
+        size_t matches = 0;
+        {
+            measurement m(name + " find", topics.size());
+            for(auto const &t: topics)
+                map.find(t, [&matches](int) { ++matches; });
+        }
+
+        {
+            measurement m(name + " remove", filters.size());
+            for(auto const &f: filters)
+                map.remove(f);
+        }
+    };
+
+    run("single exact", exact);
+    run("single +", plus);
+    run("single #", hash);
+}
+
+void BenchmarkRetainedTopicMap(benchmark_options const &options)
+{
+    topic_generator generator(options);
+
+    std::vector<std::string> topics;
+    for(size_t i = 0; i < options.subscriptions; ++i)
+        topics.push_back(generator.topic());
+
+    size_t queries = std::max<size_t>(options.iterations / 100, 1);
+    std::vector<std::string> plus_filters, hash_filters;
+    for(size_t i = 0; i < queries; ++i) {
+        plus_filters.push_back(generator.plus_filter());
+        hash_filters.push_back(generator.hash_filter());
+    }
+
+    size_t bytes_before = allocated_bytes;
+    {
+        retained_topic_map<int> map;
+        {
+            measurement m("retained insert_or_update", topics.size());
+            for(size_t i = 0; i < topics.size(); ++i)
+                map.insert_or_update(topics[i], int(i));
+        }
+
+        print_footprint("retained memory", allocated_bytes - bytes_before, map.values());
+
+        size_t matches = 0;
+        {
+            measurement m("retained find exact", topics.size());
+            for(auto const &t: topics)
+                map.find(t, [&matches](int) { ++matches; });
+        }
+
+        size_t plus_matches = 0;
+        {
+            measurement m("retained find +", plus_filters.size());
+            for(auto const &f: plus_filters)
+                map.find(f, [&plus_matches](int) { ++plus_matches; });
+        }
+
+        size_t hash_matches = 0;
+        {
+            measurement m("retained find #", hash_filters.size());
+            for(auto const &f: hash_filters)
+                map.find(f, [&hash_matches](int) { ++hash_matches; });
+        }
+
+        std::cout << "retained matches/find +: " << double(plus_matches) / plus_filters.size()
+                  << ", #: " << double(hash_matches) / hash_filters.size() << std::endl;
+
+        {
+            measurement m("retained remove", topics.size());
+            for(auto const &t: topics)
+                map.remove(t);
+        }
+    }
+}
+
+// Publishers that send the same few concrete topics over and over, with and without a
+// match_cache in front of find
+void BenchmarkMatchCache(benchmark_options const &options)
+{
+    topic_generator generator(options);
+
+    multiple_subscription_map<int> map;
+    for(size_t i = 0; i < options.subscriptions; ++i)
+        map.insert(generator.filter(), int(i));
+
+    std::vector<std::string> topics;
+    for(size_t i = 0; i < 1000; ++i)
+        topics.push_back(generator.topic());
+
+    size_t matches = 0;
+    {
+        measurement m("find uncached", options.iterations);
+        for(size_t i = 0; i < options.iterations; ++i)
+            map.find(topics[i % topics.size()], [&matches](int) { ++matches; });
+    }
+
+    match_cache< topic_generations::stamp, int > cache(4096);
+    size_t cached_matches = 0;
+    {
+        measurement m("find through match_cache", options.iterations);
+        for(size_t i = 0; i < options.iterations; ++i) {
+            auto const &topic = topics[i % topics.size()];
+            auto const &entries = cache.find(topic, map.stamp(topic), [&map, &topic](std::vector<int> &e) {
+                map.find(topic, [&e](int v) { e.push_back(v); });
+            });
+            for(int v: entries)
+                cached_matches += (v >= 0);
+        }
+    }
+
+    auto const &stats = cache.statistics();
+    std::cout << "match_cache hits " << stats.hits << ", misses " << stats.misses
+              << ", same matches: " << (matches == cached_matches ? "yes" : "no") << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    try {
+        benchmark_options options = benchmark_options::parse(argc, argv);
+
+        std::cout << "depth: " << options.depth << ", fanout: " << options.fanout
+                  << ", subscriptions: " << options.subscriptions << ", iterations: " << options.iterations << std::endl;
+
+        BenchmarkFindCallback();
+        BenchmarkSingleSubscriptionMap(options);
+        BenchmarkSubscriptionMap< multiple_subscription_map<int> >("multiple", options);
+        BenchmarkSubscriptionMap< multiple_subscription_map<int, std::deque> >("multiple deque", options);
+        BenchmarkSubscriptionMap< multiple_subscription_map<int, small_subscriber_vector> >("multiple small vector", options);
+        BenchmarkSubscriptionMap< multiple_subscription_map<int, std::vector, subscription_trie_base> >("multiple trie", options);
+        BenchmarkRetainedTopicMap(options);
+        BenchmarkMatchCache(options);
+
+        // The resident size only grows, so the pool allocator runs first: a lower size for
+        // std::allocator afterwards means it reused the memory returned by the pool run
+        BenchmarkChurn< multiple_subscription_map<int, small_subscriber_vector, subscription_map_base, pool_allocator<int> > >("pool_allocator", options);
+        BenchmarkChurn< multiple_subscription_map<int, small_subscriber_vector> >("std::allocator", options);
+    } catch(std::exception &e) {
+        std::cout << e.what() << std::endl;
+        std::cout << argv[0] << " [--depth=N] [--fanout=N] [--subscriptions=N] [--iterations=N] [--churn=N]" << std::endl;
+        return -1;
+    }
+}
@@ -0,0 +1,288 @@
+#include "precomp.h"
+
+#include "mqtt_server_cpp.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/lexical_cast.hpp>
+
+// Load generator for the broker. Subscribers subscribe to loadgen/+, publishers publish to
+// loadgen/<topic> at a fixed interval. Every payload starts with the send time, the latency
+// is measured by the subscribers when the message arrives. All clients run on one thread.
+//   MQTTSubscriptionLoadGen port [--option=value ...]
+struct loadgen_options
+{
+    std::string host = "127.0.0.1";
+    std::uint16_t port = 0;
+    std::size_t publishers = 4;
+    std::size_t subscribers = 4;
+    std::size_t topics = 16;
+    std::size_t messages = 10000;
+    std::size_t payload = 64;
+    std::size_t interval_us = 100;
+    MQTT_NS::qos qos = MQTT_NS::qos::at_most_once;
+
+    static void usage(char const *program)
+    {
+        std::cout << program << " port [--option=value ...]" << std::endl
+                  << "Options:" << std::endl
+                  << "  --host=H          broker address (default 127.0.0.1)" << std::endl
+                  << "  --publishers=N    publishing clients (default 4)" << std::endl
+                  << "  --subscribers=N   subscribing clients, each receives all messages (default 4)" << std::endl
+                  << "  --topics=N        topics the publishers publish to (default 16)" << std::endl
+                  << "  --messages=N      messages per publisher (default 10000)" << std::endl
+                  << "  --payload=N       payload size in bytes, at least 8 (default 64)" << std::endl
+                  << "  --interval-us=N   time between publishes of a publisher (default 100)" << std::endl
+                  << "  --qos=0|1|2       qos of publishes and subscriptions (default 0)" << std::endl;
+    }
+
+    static loadgen_options parse(int argc, char **argv)
+    {
+        if(argc < 2)
+            throw std::runtime_error("Missing port");
+
+        loadgen_options result;
+        result.port = boost::lexical_cast<std::uint16_t>(argv[1]);
+
+        for(int i = 2; i < argc; ++i) {
+            std::string arg(argv[i]);
+            auto separator = arg.find('=');
+            if(arg.substr(0, 2) != "--" || separator == std::string::npos)
+                throw std::runtime_error("Unexpected argument: " + arg);
+
+            std::string name = arg.substr(2, separator - 2);
+            std::string value = arg.substr(separator + 1);
+
+            if(name == "host")
+                result.host = value;
+            else if(name == "publishers")
+                result.publishers = boost::lexical_cast<std::size_t>(value);
+            else if(name == "subscribers")
+                result.subscribers = boost::lexical_cast<std::size_t>(value);
+            else if(name == "topics")
+                result.topics = boost::lexical_cast<std::size_t>(value);
+            else if(name == "messages")
+                result.messages = boost::lexical_cast<std::size_t>(value);
+            else if(name == "payload")
+                result.payload = boost::lexical_cast<std::size_t>(value);
+            else if(name == "interval-us")
+                result.interval_us = boost::lexical_cast<std::size_t>(value);
+            else if(name == "qos") {
+                auto q = boost::lexical_cast<unsigned>(value);
+                if(q > 2)
+                    throw std::runtime_error("Invalid qos: " + value);
+                result.qos = static_cast<MQTT_NS::qos>(q);
+            } else
+                throw std::runtime_error("Unknown option: " + arg);
+        }
+
+        if(result.publishers == 0 || result.subscribers == 0 || result.topics == 0)
+            throw std::runtime_error("Need at least one publisher, subscriber and topic");
+        if(result.payload < sizeof(std::int64_t))
+            throw std::runtime_error("Payload should be at least 8 bytes");
+        return result;
+    }
+};
+
+static std::int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class loadgen
+{
+    using client_t = decltype(MQTT_NS::make_async_client(std::declval<boost::asio::io_context &>(), std::string(), std::uint16_t()));
+
+    struct publisher
+    {
+        client_t client;
+        boost::asio::steady_timer timer;
+        std::size_t index;
+        std::size_t sent;
+
+        publisher(client_t const &_client, boost::asio::io_context &ioc, std::size_t _index)
+                : client(_client), timer(ioc), index(_index), sent(0)
+        { }
+    };
+
+    boost::asio::io_context &ioc;
+    loadgen_options const &options;
+
+    std::vector<client_t> subscribers;
+    std::vector< std::unique_ptr<publisher> > publishers;
+    boost::asio::steady_timer finish_timer;
+
+    std::size_t subscribed = 0;
+    std::size_t connected_publishers = 0;
+    std::size_t finished_publishers = 0;
+    std::size_t received = 0;
+
+    std::int64_t start_ns = 0;
+    std::int64_t last_receive_ns = 0;
+    std::vector<std::int64_t> latencies;
+
+    std::size_t expected() const { return options.publishers * options.messages * options.subscribers; }
+
+    void start_subscriber(std::size_t index)
+    {
+        auto c = MQTT_NS::make_async_client(ioc, options.host, options.port);
+        c->set_client_id("loadgen-sub-" + std::to_string(index));
+        c->set_clean_session(true);
+
+        c->set_connack_handler([this, c](bool, MQTT_NS::connect_return_code rc) {
+            if(rc != MQTT_NS::connect_return_code::accepted)
+                throw std::runtime_error("Subscriber connection rejected");
+            c->async_subscribe("loadgen/+", options.qos);
+            return true;
+        });
+
+        c->set_suback_handler([this](auto, auto) {
+            if(++subscribed == options.subscribers)
+                start_publishers();
+            return true;
+        });
+
+        c->set_publish_handler([this](MQTT_NS::optional<std::uint16_t>, MQTT_NS::publish_options, MQTT_NS::buffer, MQTT_NS::buffer contents) {
+            std::int64_t sent_ns;
+            if(contents.size() < sizeof(sent_ns))
+                return true;
+            std::memcpy(&sent_ns, contents.data(), sizeof(sent_ns));
+
+            last_receive_ns = now_ns();
+            latencies.push_back(last_receive_ns - sent_ns);
+
+            if(++received == expected())
+                finish();
+            return true;
+        });
+
+        c->connect();
+        subscribers.push_back(c);
+    }
+
+    // Publishers connect after all subscriptions are acknowledged, so no message is missed
+    void start_publishers()
+    {
+        for(std::size_t i = 0; i < options.publishers; ++i) {
+            auto c = MQTT_NS::make_async_client(ioc, options.host, options.port);
+            c->set_client_id("loadgen-pub-" + std::to_string(i));
+            c->set_clean_session(true);
+
+            publishers.emplace_back(new publisher(c, ioc, i));
+
+            c->set_connack_handler([this](bool, MQTT_NS::connect_return_code rc) {
+                if(rc != MQTT_NS::connect_return_code::accepted)
+                    throw std::runtime_error("Publisher connection rejected");
+
+                // Start all publishers at the same time
+                if(++connected_publishers == options.publishers) {
+                    start_ns = now_ns();
+                    for(auto &q: publishers)
+                        publish_next(*q);
+                }
+                return true;
+            });
+
+            c->connect();
+        }
+    }
+
+    void publish_next(publisher &p)
+    {
+        if(p.sent == options.messages) {
+            if(++finished_publishers == options.publishers) {
+                // Messages still in flight get some time to arrive
+                finish_timer.expires_after(std::chrono::seconds(5));
+                finish_timer.async_wait([this](boost::system::error_code const &ec) {
+                    if(!ec)
+                        finish();
+                });
+            }
+            return;
+        }
+
+        std::string payload(options.payload, 'x');
+        std::int64_t sent_ns = now_ns();
+        std::memcpy(&payload[0], &sent_ns, sizeof(sent_ns));
+
+        std::string topic = "loadgen/" + std::to_string((p.index + p.sent) % options.topics);
+        p.client->async_publish(topic, payload, options.qos | MQTT_NS::retain::no);
+        ++p.sent;
+
+        p.timer.expires_after(std::chrono::microseconds(options.interval_us));
+        p.timer.async_wait([this, &p](boost::system::error_code const &ec) {
+            if(!ec)
+                publish_next(p);
+        });
+    }
+
+    static double percentile(std::vector<std::int64_t> const &sorted, double p)
+    {
+        if(sorted.empty())
+            return 0;
+        std::size_t index = std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()));
+        return sorted[index] / 1000.0;
+    }
+
+    void finish()
+    {
+        finish_timer.cancel();
+
+        std::sort(latencies.begin(), latencies.end());
+        double seconds = (last_receive_ns - start_ns) / 1e9;
+
+        std::cout << "sent:       " << options.publishers * options.messages << std::endl
+                  << "received:   " << received << " of " << expected() << std::endl
+                  << "duration:   " << std::fixed << std::setprecision(3) << seconds << " s" << std::endl
+                  << "throughput: " << std::setprecision(0) << (seconds > 0 ? received / seconds : 0) << " msg/s" << std::endl
+                  << "latency:    p50 " << std::setprecision(1) << percentile(latencies, 0.5)
+                  << " us, p99 " << percentile(latencies, 0.99)
+                  << " us, p999 " << percentile(latencies, 0.999) << " us" << std::endl;
+
+        for(auto &p: publishers) {
+            p->timer.cancel();
+            p->client->async_disconnect();
+        }
+        for(auto &c: subscribers)
+            c->async_disconnect();
+    }
+
+public:
+    loadgen(boost::asio::io_context &_ioc, loadgen_options const &_options)
+            : ioc(_ioc), options(_options), finish_timer(_ioc)
+    {
+        latencies.reserve(expected());
+    }
+
+    void start()
+    {
+        for(std::size_t i = 0; i < options.subscribers; ++i)
+            start_subscriber(i);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    loadgen_options options;
+    try {
+        options = loadgen_options::parse(argc, argv);
+    } catch(std::exception &e) {
+        std::cout << e.what() << std::endl;
+        loadgen_options::usage(argv[0]);
+        return -1;
+    }
+
+    boost::asio::io_context ioc;
+    loadgen l(ioc, options);
+    l.start();
+    ioc.run();
+}
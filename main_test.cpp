@@ -4,9 +4,60 @@
 #include "precomp.h"
 
 #include "subscription_map.h"
+#include "subscription_trie.h"
 #include "retained_topic_map.h"
+#include "concurrent_topic_map.h"
+#include "fanout.h"
+#include "outbound_queue.h"
+#include "timing_wheel.h"
+#include "shared_subscription.h"
+#include "pool_allocator.h"
+#include "match_cache.h"
+#include "retained_store.h"
+#include "offline_queue.h"
+#include "inflight_window.h"
+#include "metrics.h"
 
+#include <cstdlib>
 #include <iostream>
+#include <new>
+#include <random>
+#include <set>
+#include <thread>
+#include <atomic>
+
+// Count the heap allocations made by the test
+static std::atomic<size_t> allocation_count(0);
+
+void *operator new(std::size_t size)
+{
+    ++allocation_count;
+    if(void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void TestPathTokenizer()
+{
+    std::cout << "Tokens should be [example] [] [test] []" << std::endl;
+    std::cout << "Tokens:";
+    for(auto const &t: mqtt_path_tokenizer("example//test/"))
+        std::cout << " [" << t << "]";
+    std::cout << std::endl;
+
+    std::cout << "Empty path should have no tokens" << std::endl;
+    std::cout << "Tokens: " << std::distance(mqtt_path_tokenizer("").begin(), mqtt_path_tokenizer("").end()) << std::endl;
+}
 
 void TestSingleSubscription()
 {
@@ -111,6 +162,302 @@ void TestMultipleSubscription()
     std::cout << "Remaining size: " << map.size() << std::endl;
 }
 
+void TestSubscriptionTrie()
+{
+    multiple_subscription_map<std::string, std::deque> map;
+    multiple_subscription_map<std::string, std::deque, subscription_trie_base> trie;
+
+    auto insert = [&](std::string const &topic) {
+        map.insert(topic, topic);
+        trie.insert(topic, topic);
+    };
+
+    auto remove = [&](std::string const &topic) {
+        map.remove(topic, topic);
+        trie.remove(topic, topic);
+    };
+
+    auto compare = [&](std::string const &topic) {
+        std::multiset<std::string> map_result, trie_result;
+        map.find(topic, [&map_result](std::string const &a) { map_result.insert(a); });
+        trie.find(topic, [&trie_result](std::string const &a) { trie_result.insert(a); });
+        std::cout << topic << ": " << map_result.size() << " matches, trie "
+                  << (map_result == trie_result ? "equal" : "DIFFERENT") << std::endl;
+    };
+
+    // Enough children to move the child index of "fanout" from its inline array to the hash
+    for(int i = 0; i < 10; ++i)
+        insert("fanout/" + std::to_string(i) + "/A");
+    insert("fanout/+/A");
+    insert("fanout/#");
+    insert("+/3/#");
+
+    std::cout << "Trie and hash map should find the same subscriptions" << std::endl;
+    compare("fanout/3/A");
+    compare("fanout/4/B");
+
+    for(int i = 0; i < 8; ++i)
+        remove("fanout/" + std::to_string(i) + "/A");
+    remove("fanout/#");
+
+    compare("fanout/3/A");
+    compare("fanout/9/A");
+
+    remove("fanout/8/A");
+    remove("fanout/9/A");
+    remove("fanout/+/A");
+    remove("+/3/#");
+
+    std::cout << "Remaining size should be 1 (root element only)" << std::endl;
+    std::cout << "Remaining size: " << map.size() << ", trie: " << trie.size() << std::endl;
+}
+
+struct counted_child
+{
+    static int destroyed;
+
+    std::string key;
+
+    explicit counted_child(std::string _key) : key(std::move(_key)) { }
+    ~counted_child() { ++destroyed; }
+};
+
+int counted_child::destroyed = 0;
+
+void TestTrieChildErase()
+{
+    trie_child_index<counted_child> index;
+    std::vector<counted_child *> children;
+    for(auto key: { "a", "b", "c" })
+        children.push_back(index.insert(std::make_unique<counted_child>(key)));
+
+    // Erasing the last inline child, and a child which is replaced by the last one
+    index.erase(children[2]);
+    std::cout << "Destroyed after erasing the last child should be 1" << std::endl;
+    std::cout << "Destroyed after erasing the last child: " << counted_child::destroyed << std::endl;
+
+    index.erase(children[0]);
+    std::cout << "Destroyed after erasing the first child should be 2, remaining b" << std::endl;
+    std::cout << "Destroyed after erasing the first child: " << counted_child::destroyed << ", remaining "
+              << (index.find("b") != nullptr ? "b" : "none") << std::endl;
+}
+
+template<typename Map>
+void TestHandles(std::string const &name)
+{
+    Map map;
+    std::vector<typename Map::handle> handles;
+    for(int i = 0; i < 8; ++i)
+        handles.push_back(map.insert("example/#", i));
+
+    // Remove every other value, the free slots are reused by the next inserts
+    for(int i = 0; i < 8; i += 2)
+        map.remove("example/#", handles[i]);
+    handles[0] = map.insert("example/#", 10);
+
+    std::multiset<int> result;
+    map.find("example/test/A", [&result](int i) { result.insert(i); });
+
+    std::cout << name << " values should be 1 3 5 7 10" << std::endl;
+    std::cout << name << " values:";
+    for(int i: result)
+        std::cout << " " << i;
+    std::cout << std::endl;
+
+    map.remove("example/#", handles[0]);
+    for(int i = 1; i < 8; i += 2)
+        map.remove("example/#", handles[i]);
+
+    std::cout << "Remaining size should be 1 (root element only)" << std::endl;
+    std::cout << "Remaining size: " << map.size() << std::endl;
+}
+
+void TestSubscriptionHandles()
+{
+    TestHandles< multiple_subscription_map<int> >("hash");
+    TestHandles< multiple_subscription_map<int, std::deque, subscription_trie_base> >("trie");
+}
+
+void TestConcurrentSubscriptions()
+{
+    concurrent_topic_map< multiple_subscription_map<int> > map;
+    map.insert("example/#", -1);
+
+    std::atomic<size_t> matches(0);
+
+    // Readers search the map while it is modified
+    std::vector<std::thread> readers;
+    for(int r = 0; r < 4; ++r) {
+        readers.emplace_back([&map, &matches] {
+            for(int i = 0; i < 10000; ++i)
+                map.find("example/test/A", [&matches](int) { ++matches; });
+        });
+    }
+
+    for(int i = 0; i < 10000; ++i) {
+        map.insert("example/test/A", i);
+        map.insert("example/+/A", i);
+        map.remove("example/+/A", i);
+        map.remove("example/test/A", i);
+    }
+
+    for(auto &t: readers)
+        t.join();
+
+    map.remove("example/#", -1);
+
+    std::cout << "Readers found matches: " << (matches > 0 ? "yes" : "no") << std::endl;
+    std::cout << "Remaining size should be 1 (root element only)" << std::endl;
+    std::cout << "Remaining size: " << map.size() << std::endl;
+}
+
+struct fanout_subscriber
+{
+    std::string name;
+    std::vector<fanout_stamp> fanout_stamps;
+
+    fanout_subscriber(std::string const &_name)
+        : name(_name), fanout_stamps(1)
+    { }
+};
+
+void TestFanout()
+{
+    fanout_subscriber a("A"), b("B");
+
+    multiple_subscription_map< std::pair<fanout_subscriber *, MQTT_NS::qos> > map;
+    map.insert("example/test/A", std::make_pair(&a, MQTT_NS::qos::at_most_once));
+    map.insert("example/+/A", std::make_pair(&a, MQTT_NS::qos::exactly_once));
+    map.insert("example/#", std::make_pair(&a, MQTT_NS::qos::at_least_once));
+    map.insert("example/#", std::make_pair(&b, MQTT_NS::qos::at_least_once));
+
+    fanout_collector<fanout_subscriber> subscribers(0);
+    for(int publish = 0; publish < 2; ++publish) {
+        subscribers.clear();
+        map.find("example/test/A", [&subscribers](std::pair<fanout_subscriber *, MQTT_NS::qos> const &r) {
+            subscribers.add(*r.first, r.second);
+        });
+
+        std::cout << "Subscribers should be A qos 2, B qos 1" << std::endl;
+        subscribers.for_each([](fanout_subscriber &s, MQTT_NS::qos qos) {
+            std::cout << "Subscriber: " << s.name << " qos " << qos << std::endl;
+        });
+    }
+}
+
+struct batched_subscriber
+        : std::enable_shared_from_this<batched_subscriber>
+{
+    std::string name;
+    std::size_t thread_index;
+
+    batched_subscriber(std::string const &_name, std::size_t _thread_index)
+        : name(_name), thread_index(_thread_index)
+    { }
+};
+
+void TestFanoutBatches()
+{
+    auto a = std::make_shared<batched_subscriber>("A", 0);
+    auto b = std::make_shared<batched_subscriber>("B", 2);
+    auto c = std::make_shared<batched_subscriber>("C", 0);
+
+    fanout_batches<batched_subscriber> batches(3);
+    batches.add(*a, MQTT_NS::qos::at_most_once);
+    batches.add(*b, MQTT_NS::qos::at_least_once);
+    batches.add(*c, MQTT_NS::qos::exactly_once);
+
+    std::cout << "Batches should be [A C] [B]" << std::endl;
+    std::cout << "Batches:";
+    void const *delivered = nullptr;
+    batches.flush([&delivered](fanout_batches<batched_subscriber>::lease &&batch) {
+        delivered = batch->data();
+        std::cout << " [";
+        for(auto const &r: *batch)
+            std::cout << (&r == &batch->front() ? "" : " ") << r.first->name;
+        std::cout << "]";
+    });
+    std::cout << std::endl;
+
+    std::size_t remaining = 0;
+    batches.flush([&remaining](fanout_batches<batched_subscriber>::lease &&) { ++remaining; });
+    std::cout << "Batches after flush should be 0" << std::endl;
+    std::cout << "Batches after flush: " << remaining << std::endl;
+
+    // The buffer of a delivered batch collects the recipients of a later publish, without allocating
+    bool reused = false;
+    for(int i = 0; i < 2; ++i) {
+        batches.add(*a, MQTT_NS::qos::at_most_once);
+        batches.flush([&reused, delivered](fanout_batches<batched_subscriber>::lease &&batch) { reused = batch->data() == delivered; });
+    }
+    std::cout << "Delivered batch reused should be yes" << std::endl;
+    std::cout << "Delivered batch reused: " << (reused ? "yes" : "no") << std::endl;
+}
+
+void TestOutboundStatistics()
+{
+    outbound_statistics stats;
+    stats.add_batch(1, 10);
+    stats.add_batch(3, 30);
+    stats.add_batch(1000, 100);
+
+    std::cout << "Batches per size should be 1 1 0 0 0 0 0 1" << std::endl;
+    std::cout << "Batches per size:";
+    for(auto count: stats.histogram)
+        std::cout << " " << count;
+    std::cout << std::endl;
+
+    stats.queued(100);
+    stats.queued(50);
+    stats.dequeued(100);
+    std::cout << "Queued should be 1 publish, 50 bytes, max 150 bytes" << std::endl;
+    std::cout << "Queued: " << stats.queued_messages << " publish, " << stats.queued_bytes << " bytes, max "
+              << stats.max_queued_bytes << " bytes" << std::endl;
+
+    std::cout << "Policy should be disconnect" << std::endl;
+    std::cout << "Policy: " << slow_consumer_policy_name(slow_consumer_policy_from_name("disconnect")) << std::endl;
+}
+
+void TestFindAllocations()
+{
+    multiple_subscription_map<int> map;
+    multiple_subscription_map<int, std::vector, subscription_trie_base> trie;
+    retained_topic_map<int> retained;
+
+    // Wildcard heavy subscriptions, with a frontier larger than the inline buffer of the frontier
+    for(int i = 0; i < 32; ++i) {
+        std::string level = std::to_string(i);
+        for(auto const &topic: { "site/" + level + "/+/+/A", "site/+/" + level + "/+/A", std::string("site/+/+/+/#") }) {
+            map.insert(topic, i);
+            trie.insert(topic, i);
+        }
+        for(int j = 0; j < 32; ++j)
+            retained.insert_or_update("site/" + level + "/" + std::to_string(j) + "/A", j);
+    }
+
+    size_t matches = 0;
+    auto count = [&matches](int) { ++matches; };
+
+    auto find_all = [&]() {
+        map.find("site/1/2/3/A", count);
+        trie.find("site/1/2/3/A", count);
+        retained.find("site/+/+/A", count);
+        retained.find("site/1/#", count);
+    };
+
+    // The first find grows the buffers of the frontier
+    find_all();
+
+    size_t before = allocation_count;
+    for(int i = 0; i < 100; ++i)
+        find_all();
+    size_t after = allocation_count;
+
+    std::cout << "Matches: " << matches << std::endl;
+    std::cout << "Allocations during find should be 0" << std::endl;
+    std::cout << "Allocations during find: " << (after - before) << std::endl;
+}
+
 void TestRetainedTopics()
 {
     retained_topic_map<std::string> map;
@@ -146,6 +493,45 @@ void TestRetainedTopics()
 
 }
 
+void TestRetainedWildcards()
+{
+    retained_topic_map<std::string> map;
+    map.insert_or_update("site", "site");
+    map.insert_or_update("site/A/1", "site/A/1");
+    map.insert_or_update("site/A/2", "site/A/2");
+    map.insert_or_update("site/B/1", "site/B/1");
+    map.insert_or_update("other/A/1", "other/A/1");
+
+    auto print_count = [&map](std::string const &topic) {
+        size_t count = 0;
+        map.find(topic, [&count](std::string const &) { ++count; });
+        std::cout << topic << ": " << count << std::endl;
+    };
+
+    std::cout << "Matches should be 5, 4, 2, 3" << std::endl;
+    print_count("#");
+    print_count("site/#");
+    print_count("site/+/1");
+    print_count("+/A/+");
+
+    // Stream the matches in steps of 2 values, the map can change between steps
+    std::cout << "Steps should be 2, 1" << std::endl;
+    auto cursor = map.find_cursor("site/#");
+    map.remove("site/B/1");
+    while(!cursor.done()) {
+        size_t step = map.find_next(cursor, 2, [](std::string const &) { });
+        std::cout << "Step: " << step << std::endl;
+    }
+
+    map.remove("site");
+    map.remove("site/A/1");
+    map.remove("site/A/2");
+    map.remove("other/A/1");
+
+    std::cout << "Remaining size should be 1 (root element only)" << std::endl;
+    std::cout << "Remaining size: " << map.size() << std::endl;
+}
+
 #include <mqtt/subscribe_options.hpp>
 #include <mqtt/buffer.hpp>
 
@@ -187,6 +573,469 @@ class session_db
     session_index sessions;
 };
 
+void TestTopicLevelPool()
+{
+    topic_level_pool &pool = topic_level_pool::instance();
+    size_t initial = pool.size();
+
+    {
+        multiple_subscription_map<int> map;
+        retained_topic_map<int> retained;
+
+        map.insert("sensors/+/status", 1);
+        map.insert("sensors/kitchen/#", 2);
+        retained.insert_or_update("sensors/kitchen/status", 3);
+        retained.insert_or_update("sensors/hall/status", 4);
+
+        std::cout << "Interned levels should be 4 (sensors kitchen status hall)" << std::endl;
+        std::cout << "Interned levels: " << pool.size() - initial << std::endl;
+
+        map.remove("sensors/kitchen/#", 2);
+        retained.remove("sensors/kitchen/status");
+
+        std::cout << "Interned levels should be 3 (sensors hall status)" << std::endl;
+        std::cout << "Interned levels: " << pool.size() - initial << std::endl;
+    }
+
+    std::cout << "Destroyed maps release their levels, interned levels should be 0" << std::endl;
+    std::cout << "Interned levels: " << pool.size() - initial << std::endl;
+}
+
+void TestPoolAllocator()
+{
+    multiple_subscription_map<int, small_subscriber_vector, subscription_map_base, pool_allocator<int> > map;
+    multiple_subscription_map<int, std::vector, subscription_trie_base, pool_allocator<int> > trie;
+    retained_topic_map<int, pool_allocator<int> > retained;
+
+    // Nodes are created on another thread, the blocks move to the cache of the thread which frees them
+    std::thread([&] {
+        for(int i = 0; i < 100; ++i) {
+            map.insert("pool/" + std::to_string(i) + "/+", i);
+            trie.insert("pool/" + std::to_string(i) + "/+", i);
+            retained.insert_or_update("pool/" + std::to_string(i) + "/A", i);
+        }
+    }).join();
+
+    size_t matches = 0;
+    auto count = [&matches](int) { ++matches; };
+    map.find("pool/7/A", count);
+    trie.find("pool/7/A", count);
+    retained.find("pool/+/A", count);
+
+    std::cout << "Pool allocated maps should find 102 values" << std::endl;
+    std::cout << "Values found: " << matches << std::endl;
+
+    for(int i = 0; i < 100; ++i) {
+        map.remove("pool/" + std::to_string(i) + "/+", i);
+        trie.remove("pool/" + std::to_string(i) + "/+", i);
+        retained.remove("pool/" + std::to_string(i) + "/A");
+    }
+
+    std::cout << "Remaining size should be 1 1 1 (root element only)" << std::endl;
+    std::cout << "Remaining size: " << map.size() << " " << trie.size() << " " << retained.size() << std::endl;
+}
+
+void TestMatchCache()
+{
+    multiple_subscription_map<int> map;
+    match_cache< topic_generations::stamp, int > cache(2);
+
+    map.insert("example/+/A", 1);
+
+    auto find = [&](std::string const &topic) {
+        auto const &entries = cache.find(topic, map.stamp(topic), [&map, &topic](std::vector<int> &e) {
+            map.find(topic, [&e](int i) { e.push_back(i); });
+        });
+        std::cout << topic << ":";
+        for(int i: entries)
+            std::cout << " " << i;
+        std::cout << std::endl;
+    };
+
+    std::cout << "Second find should be a hit, the find after the insert should be stale" << std::endl;
+    find("example/test/A");
+    find("example/test/A");
+    map.insert("example/#", 2);
+    find("example/test/A");
+
+    std::cout << "An insert for another first level should not invalidate the topic" << std::endl;
+    map.insert("other/A", 3);
+    find("example/test/A");
+
+    std::cout << "Two more topics should evict one topic" << std::endl;
+    find("example/other/A");
+    find("other/A");
+
+    auto const &stats = cache.statistics();
+    std::cout << "Hits should be 2, misses 3, stale 1, evictions 1" << std::endl;
+    std::cout << "Hits " << stats.hits << ", misses " << stats.misses << ", stale " << stats.stale
+              << ", evictions " << stats.evictions << std::endl;
+}
+
+struct wheel_timer
+{
+    std::uint64_t expiry;
+    timing_wheel<wheel_timer>::hook hook;
+    std::uint64_t expired_at;
+
+    explicit wheel_timer(std::uint64_t _expiry)
+        : expiry(_expiry), hook(this), expired_at(0)
+    { }
+};
+
+void TestTimingWheel()
+{
+    timing_wheel<wheel_timer> wheel(1000);
+
+    // Delays in every level of the wheel, and one beyond its range
+    std::vector<std::unique_ptr<wheel_timer>> timers;
+    for(std::uint64_t delay: { 1, 63, 64, 65, 4095, 4096, 300000, 16777300 })
+        timers.push_back(std::make_unique<wheel_timer>(1000 + delay));
+    for(auto &t: timers)
+        wheel.schedule(t->hook, t->expiry);
+
+    // Reset the second timer and cancel the third
+    timers[1]->expiry += 100;
+    wheel.schedule(timers[1]->hook, timers[1]->expiry);
+    wheel.cancel(timers[2]->hook);
+
+    std::size_t expired = 0;
+    for(std::uint64_t now = 1000; now < 1000 + 16777300 + 997; now += 997) {
+        wheel.advance(now, [&wheel, &expired](wheel_timer &t) {
+            t.expired_at = wheel.now();
+            ++expired;
+        });
+    }
+
+    std::size_t exact = 0;
+    for(auto &t: timers)
+        exact += t->expired_at == t->expiry ? 1 : 0;
+
+    std::cout << "Expired timers should be 7, on time 7" << std::endl;
+    std::cout << "Expired timers: " << expired << ", on time " << exact << std::endl;
+}
+
+void TestSharedSubscriptions()
+{
+    auto shared = parse_shared_filter("$share/workers/sensors/+/temperature");
+    std::cout << "Group and filter should be workers sensors/+/temperature" << std::endl;
+    std::cout << "Group and filter: " << shared->group << " " << shared->filter << std::endl;
+
+    std::cout << "Invalid shared subscriptions should be rejected 2 times" << std::endl;
+    for(auto filter: { "$share/workers", "$share/work+ers/sensors" }) {
+        try {
+            parse_shared_filter(filter);
+        } catch(std::exception &e) {
+            std::cout << "Rejected: " << e.what() << std::endl;
+        }
+    }
+
+    typedef std::pair<std::string, std::size_t> member_type;
+    auto queued = [](member_type const &m) { return m.second; };
+
+    shared_subscription_map<member_type> map;
+    auto a = map.insert(*shared, member_type("A", 5));
+    auto b = map.insert(*shared, member_type("B", 1));
+    auto c = map.insert(*shared, member_type("C", 3));
+    map.insert(*parse_shared_filter("$share/loggers/sensors/#"), member_type("D", 0));
+
+    std::cout << "Round robin should deliver to A B C A, and to D every time" << std::endl;
+    for(int i = 0; i < 4; ++i) {
+        map.find("sensors/kitchen/temperature", [&queued](share_group<member_type> const &group) {
+            std::cout << group.name() << ": " << group.select(shared_delivery::round_robin, queued).first << std::endl;
+        });
+    }
+
+    std::cout << "Least queued should deliver to B" << std::endl;
+    map.find("sensors/kitchen/temperature", [&queued](share_group<member_type> const &group) {
+        if(group.name() == "workers")
+            std::cout << "Least queued: " << group.select(shared_delivery::least_queued, queued).first << std::endl;
+    });
+
+    map.remove(b);
+    map.remove(a);
+    std::cout << "Least queued after removing B and A should deliver to C" << std::endl;
+    map.find("sensors/kitchen/temperature", [&queued](share_group<member_type> const &group) {
+        if(group.name() == "workers")
+            std::cout << "Least queued: " << group.select(shared_delivery::least_queued, queued).first << std::endl;
+    });
+    std::cout << "Groups should be 2" << std::endl;
+    std::cout << "Groups: " << map.size() << std::endl;
+
+    map.remove(c);
+    std::cout << "Groups after removing the last member should be 1" << std::endl;
+    std::cout << "Groups: " << map.size() << std::endl;
+}
+
+// Suffix for the temporary directories of a test run
+std::string unique_suffix()
+{
+    static std::string const suffix = std::to_string(std::random_device()() ^ std::uint32_t(std::chrono::steady_clock::now().time_since_epoch().count()));
+    return suffix;
+}
+
+// The retained store is not available on Windows
+#ifndef _WIN32
+struct stored_message
+{
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+    MQTT_NS::qos qos;
+};
+
+void TestRetainedStore()
+{
+    typedef concurrent_topic_map< retained_topic_map<stored_message> > map_type;
+
+    // The store logs at info level from its writer thread
+    logger::instance().set_level(log_level::warning);
+
+    auto directory = std::filesystem::temp_directory_path() / ("retained_store_test_" + unique_suffix());
+    std::filesystem::remove_all(directory);
+
+    auto modify = [](map_type &map, retained_store &store, std::string const &topic, std::string const &contents) {
+        map.modify([&](auto &m) {
+            auto t = MQTT_NS::allocate_buffer(topic);
+            if(contents.empty()) {
+                m.remove(t);
+                store.remove(t);
+            } else {
+                m.insert_or_update(t, stored_message{ t, MQTT_NS::allocate_buffer(contents), MQTT_NS::qos::at_least_once });
+                store.update(t, contents, MQTT_NS::qos::at_least_once);
+            }
+        });
+    };
+
+    auto print = [](map_type &map) {
+        std::vector<std::string> messages;
+        map.find("#", [&messages](stored_message const &m) {
+            messages.push_back(std::string(m.topic) + "=" + std::string(m.contents));
+        });
+        std::sort(messages.begin(), messages.end());
+        for(auto const &m: messages)
+            std::cout << " " << m;
+        std::cout << std::endl;
+    };
+
+    // Compact after every sync
+    {
+        map_type map;
+        retained_store store(directory.string(), std::chrono::milliseconds(1), 1);
+        store.load(map);
+        store.start(map);
+        modify(map, store, "sensors/kitchen", "21");
+        modify(map, store, "sensors/hall", "19");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        modify(map, store, "sensors/kitchen", "22");
+        modify(map, store, "sensors/attic", "15");
+        modify(map, store, "sensors/hall", "");
+    }
+
+    {
+        map_type map;
+        retained_store store(directory.string(), std::chrono::milliseconds(1), 1024 * 1024);
+        store.load(map);
+        std::cout << "Restored messages should be sensors/attic=15 sensors/kitchen=22" << std::endl;
+        std::cout << "Restored messages:";
+        print(map);
+    }
+
+    std::cout << "Snapshot should exist: yes" << std::endl;
+    std::cout << "Snapshot exists: " << (std::filesystem::exists(directory / "retained.snapshot") ? "yes" : "no") << std::endl;
+    std::filesystem::remove_all(directory);
+    logger::instance().set_level(log_level::info);
+}
+#endif
+
+struct offline_message
+{
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+};
+
+void TestOfflineQueue()
+{
+    offline_limits limits;
+    limits.memory_bytes = 64;
+    limits.max_bytes = 220;
+    limits.directory = (std::filesystem::temp_directory_path() / ("offline_queue_test_" + unique_suffix())).string();
+
+    // 22 bytes per message, 2 fit in memory and 10 in the queue
+    offline_queue<offline_message> queue(limits);
+    std::size_t pushed = 0;
+    for(int i = 0; i < 12; ++i) {
+        auto contents = MQTT_NS::allocate_buffer("message " + std::to_string(i) + std::string(i < 10 ? 1 : 0, ' '));
+        auto message = std::make_shared<offline_message const>(offline_message{ MQTT_NS::allocate_buffer("sensors/hall"), contents });
+        pushed += queue.push(message, MQTT_NS::qos::at_least_once) ? 1 : 0;
+    }
+
+    std::cout << "Queued should be 10, spilled segment files 1" << std::endl;
+    std::cout << "Queued: " << pushed << ", spilled segment files "
+              << std::distance(std::filesystem::directory_iterator(limits.directory), std::filesystem::directory_iterator()) << std::endl;
+
+    std::cout << "Messages should be 0 to 9, in batches of 4" << std::endl;
+    while(!queue.empty()) {
+        std::cout << "Batch:";
+        queue.pop(4, [](offline_queue<offline_message>::entry_type &&e) {
+            std::cout << " " << e.first->contents.substr(8, 1);
+        });
+        std::cout << std::endl;
+    }
+
+    // A publish larger than the memory budget is read back by itself
+    for(std::size_t size: { 10, 100, 10 }) {
+        auto contents = MQTT_NS::allocate_buffer(std::string(size, 'x'));
+        queue.push(std::make_shared<offline_message const>(offline_message{ MQTT_NS::allocate_buffer("sensors/hall"), contents }), MQTT_NS::qos::at_least_once);
+    }
+
+    std::cout << "Content sizes should be 10 100 10" << std::endl;
+    std::cout << "Content sizes:";
+    while(!queue.empty()) {
+        queue.pop(4, [](offline_queue<offline_message>::entry_type &&e) {
+            std::cout << " " << e.first->contents.size();
+        });
+    }
+    std::cout << std::endl;
+
+    std::cout << "Segment files after the queue is empty should be 0" << std::endl;
+    std::cout << "Segment files: " << std::distance(std::filesystem::directory_iterator(limits.directory), std::filesystem::directory_iterator()) << std::endl;
+    std::filesystem::remove_all(limits.directory);
+}
+
+void TestInflightWindow()
+{
+    auto message = std::make_shared<offline_message const>(offline_message{ MQTT_NS::allocate_buffer("sensors/hall"), MQTT_NS::allocate_buffer("on") });
+    inflight_window<offline_message> window(4);
+
+    std::cout << "Packet ids should be 1 2 3 4, full 1" << std::endl;
+    std::cout << "Packet ids:";
+    for(int i = 0; i < 4; ++i)
+        std::cout << " " << window.add(message, i % 2 ? MQTT_NS::qos::exactly_once : MQTT_NS::qos::at_least_once, 10);
+    std::cout << ", full " << window.full() << std::endl;
+
+    // The window stays full until the oldest publish is acknowledged
+    window.acknowledge(2);
+    window.received(4, 15);
+    std::cout << "Full after acknowledging 2 should be 1, after acknowledging 1 should be 0" << std::endl;
+    std::cout << "Full after acknowledging 2: " << window.full();
+    window.acknowledge(1);
+    std::cout << ", after acknowledging 1: " << window.full() << std::endl;
+
+    std::cout << "Unknown packet ids should be ignored: 0 0 0" << std::endl;
+    std::cout << "Unknown packet ids: " << window.acknowledge(1) << " " << window.acknowledge(9) << " " << window.received(3, 15) << std::endl;
+
+    std::cout << "Expired at 25 should be 3, expired at 30 should be 4 (pubrel), next expiry 45" << std::endl;
+    auto print = [](inflight_window<offline_message>::entry &e) {
+        std::cout << " " << e.packet_id << (e.state == inflight_window<offline_message>::phase::release ? " (pubrel)" : "");
+    };
+    std::cout << "Expired at 25:";
+    window.expire(25, 15, print);
+    std::cout << ", expired at 30:";
+    window.expire(30, 15, print);
+    std::cout << ", next expiry " << window.next_expiry(20) << std::endl;
+
+    // 65535 is not a multiple of 4, the ids wrap at 65532 to keep the ring in order
+    window.acknowledge(3);
+    window.acknowledge(4);
+    for(std::uint16_t id = 0; id != 65531; ) {
+        id = window.add(message, MQTT_NS::qos::at_least_once, 30);
+        window.acknowledge(id);
+    }
+
+    std::cout << "Packet ids after wrapping should be 65532 1 2 3, full 1" << std::endl;
+    std::cout << "Packet ids after wrapping:";
+    for(int i = 0; i < 4; ++i)
+        std::cout << " " << window.add(message, MQTT_NS::qos::at_least_once, 30);
+    std::cout << ", full " << window.full() << std::endl;
+}
+
+template<typename Map>
+void TestSystemTopics(std::string const &name)
+{
+    Map map;
+    map.insert("#", 1);
+    map.insert("+/broker/#", 2);
+    map.insert("$SYS/#", 3);
+    map.insert("$SYS/+/clients", 4);
+
+    std::cout << name << " system topic values should be 3 4, other topic values 1 2" << std::endl;
+    for(auto topic: { "$SYS/broker/clients", "sensors/broker/clients" }) {
+        std::multiset<int> result;
+        map.find(topic, [&result](int i) { result.insert(i); });
+        std::cout << (topic[0] == '$' ? name + " system topic values:" : ", other topic values:");
+        for(int i: result)
+            std::cout << " " << i;
+    }
+    std::cout << std::endl;
+}
+
+void TestRetainedSystemTopics()
+{
+    retained_topic_map<int> map;
+    map.insert_or_update("$SYS/broker/clients", 1);
+    map.insert_or_update("sensors/broker/clients", 2);
+
+    auto print_values = [&map](std::string const &topic) {
+        std::multiset<int> result;
+        map.find(topic, [&result](int i) { result.insert(i); });
+        std::cout << topic << ":";
+        for(int i: result)
+            std::cout << " " << i;
+        std::cout << std::endl;
+    };
+
+    std::cout << "Retained values should be 2, 2, 1, 1" << std::endl;
+    print_values("#");
+    print_values("+/broker/#");
+    print_values("$SYS/#");
+    print_values("$SYS/+/clients");
+}
+
+void TestMetrics()
+{
+    log2_histogram<8> histogram;
+    for(std::uint64_t value: { 0, 1, 2, 3, 4, 100, 1000 })
+        histogram.add(value);
+
+    // 1000 is counted in the last bucket
+    std::cout << "Buckets should be 1 1 2 1 0 0 0 2, p50 3, p99 127" << std::endl;
+    std::cout << "Buckets:";
+    for(auto count: histogram.buckets)
+        std::cout << " " << count;
+    std::cout << ", p50 " << histogram.quantile(0.5) << ", p99 " << histogram.quantile(0.99) << std::endl;
+
+    // The counters of two threads added up
+    publish_metrics a, b;
+    a.messages_in = 10;
+    a.fanout.add(3);
+    b.messages_in = 5;
+    b.fanout.add(3);
+    b.find_latency.add(250);
+
+    metrics_snapshot snapshot;
+    snapshot.publishes.merge(a);
+    snapshot.publishes.merge(b);
+    snapshot.connected_clients = 2;
+
+    std::map<std::string, std::string> topics;
+    snapshot.for_each_sys_topic([&topics](std::string const &topic, std::string const &payload) {
+        topics[topic] = payload;
+    });
+    std::cout << "Received should be 15, connected 2, fanout p50 3, find latency p50 255" << std::endl;
+    std::cout << "Received " << topics["$SYS/broker/messages/received"] << ", connected " << topics["$SYS/broker/clients/connected"]
+              << ", fanout p50 " << topics["$SYS/broker/publish/fanout/p50"] << ", find latency p50 " << topics["$SYS/broker/publish/find-latency/p50"] << std::endl;
+
+    std::string text = snapshot.prometheus_text();
+    std::cout << "Prometheus lines should be found: 1 1 1" << std::endl;
+    std::cout << "Prometheus lines found: " << (text.find("\nmqtt_messages_received_total 15\n") != std::string::npos)
+              << " " << (text.find("\nmqtt_publish_fanout_bucket{le=\"3\"} 2\n") != std::string::npos)
+              << " " << (text.find("\nmqtt_find_latency_nanoseconds_count 1\n") != std::string::npos) << std::endl;
+
+    TestSystemTopics< multiple_subscription_map<int> >("hash");
+    TestSystemTopics< multiple_subscription_map<int, std::deque, subscription_trie_base> >("trie");
+    TestRetainedSystemTopics();
+}
+
 void TestSessions()
 {
 
@@ -195,9 +1044,30 @@ void TestSessions()
 int main(int, char**)
 {
     try {
+        TestPathTokenizer();
         TestSingleSubscription();
         TestMultipleSubscription();
+        TestSubscriptionTrie();
+        TestTrieChildErase();
+        TestSubscriptionHandles();
+        TestConcurrentSubscriptions();
+        TestFanout();
+        TestFanoutBatches();
+        TestOutboundStatistics();
+        TestFindAllocations();
         TestRetainedTopics();
+        TestRetainedWildcards();
+        TestTopicLevelPool();
+        TestPoolAllocator();
+        TestMatchCache();
+        TestTimingWheel();
+        TestSharedSubscriptions();
+#ifndef _WIN32
+        TestRetainedStore();
+#endif
+        TestOfflineQueue();
+        TestInflightWindow();
+        TestMetrics();
         TestSessions();
 
     } catch(std::exception &e)
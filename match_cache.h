@@ -0,0 +1,142 @@
+#ifndef MQTTSUBSCRIPTION_MATCH_CACHE_H
+#define MQTTSUBSCRIPTION_MATCH_CACHE_H
+
+#include <mqtt/string_view.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+struct match_cache_statistics
+{
+    std::uint64_t hits = 0;
+
+    // Topics that were not cached
+    std::uint64_t misses = 0;
+
+    // Cached topics of which the subscriptions were modified since they were cached
+    std::uint64_t stale = 0;
+
+    std::uint64_t evictions = 0;
+};
+
+// Caches the entries matching a publish topic, for example the deduplicated subscribers of
+// the topic. Every cached topic is stored with the stamp of the map at the time it was
+// matched, the entries are used as long as the map returns the same stamp for the topic.
+// At most capacity topics are cached, the least recently used topics are evicted with the
+// CLOCK algorithm. Not thread safe, intended as a cache per thread.
+template<typename Stamp, typename Entry>
+class match_cache
+{
+    struct topic_hash
+    {
+        std::size_t operator()(MQTT_NS::string_view const &topic) const { return boost::hash_range(topic.begin(), topic.end()); }
+    };
+
+    struct slot
+    {
+        std::string topic;
+        Stamp stamp;
+        std::vector<Entry> entries;
+        bool referenced = false;
+    };
+
+    std::size_t capacity;
+    std::size_t hand;
+
+    // Reserved up front, the index refers to the topics stored in the slots
+    std::vector<slot> slots;
+    boost::unordered_map< MQTT_NS::string_view, std::size_t, topic_hash > index;
+
+    // Holds the entries when caching is disabled
+    std::vector<Entry> uncached;
+
+    match_cache_statistics stats;
+
+    // Find a slot to reuse, recently used slots get a second chance
+    std::size_t evict()
+    {
+        while(slots[hand].referenced) {
+            slots[hand].referenced = false;
+            hand = (hand + 1) % capacity;
+        }
+
+        std::size_t result = hand;
+        hand = (hand + 1) % capacity;
+
+        index.erase(MQTT_NS::string_view(slots[result].topic));
+        ++stats.evictions;
+        return result;
+    }
+
+public:
+    // A capacity of 0 disables caching
+    explicit match_cache(std::size_t _capacity)
+            : capacity(_capacity), hand(0)
+    {
+        slots.reserve(capacity);
+    }
+
+    match_cache(match_cache const &) = delete;
+    match_cache &operator=(match_cache const &) = delete;
+
+    // Return the entries matching topic. When the topic is not cached, or it is cached with
+    // another stamp, fill(std::vector<Entry> &) is called to add the entries of the topic.
+    template<typename F>
+    std::vector<Entry> const &find(MQTT_NS::string_view const &topic, Stamp const &stamp, F &&fill)
+    {
+        if(capacity == 0) {
+            ++stats.misses;
+            uncached.clear();
+            fill(uncached);
+            return uncached;
+        }
+
+        auto i = index.find(topic);
+        if(i != index.end()) {
+            slot &s = slots[i->second];
+            s.referenced = true;
+
+            if(s.stamp == stamp) {
+                ++stats.hits;
+                return s.entries;
+            }
+
+            ++stats.stale;
+            s.stamp = stamp;
+            s.entries.clear();
+            fill(s.entries);
+            return s.entries;
+        }
+
+        ++stats.misses;
+
+        std::size_t n;
+        if(slots.size() < capacity) {
+            n = slots.size();
+            slots.emplace_back();
+        } else {
+            n = evict();
+        }
+
+        // The entries of an evicted slot keep their capacity
+        slot &s = slots[n];
+        s.topic.assign(topic.data(), topic.size());
+        s.stamp = stamp;
+        s.entries.clear();
+        s.referenced = false;
+        fill(s.entries);
+
+        index.emplace(MQTT_NS::string_view(s.topic), n);
+        return s.entries;
+    }
+
+    match_cache_statistics const &statistics() const { return stats; }
+
+    std::size_t size() const { return index.size(); }
+};
+
+#endif //MQTTSUBSCRIPTION_MATCH_CACHE_H
@@ -0,0 +1,76 @@
+#ifndef MQTTSUBSCRIPTION_MATCH_FRONTIER_H
+#define MQTTSUBSCRIPTION_MATCH_FRONTIER_H
+
+#include <memory>
+#include <vector>
+
+#include <boost/container/small_vector.hpp>
+
+// The entries matched at the current level of a topic, and the entries matched at the next
+// level. Moving to the next level swaps the buffers instead of copying them. Frontiers are
+// leased from a per-thread free list and keep their capacity, so a find does not allocate
+// once the buffers have grown to the largest frontier seen.
+template<typename Entry, std::size_t InlineSize = 16>
+class match_frontier
+{
+public:
+    typedef boost::container::small_vector<Entry, InlineSize> buffer_type;
+
+private:
+    buffer_type buffers[2];
+    std::size_t current_index;
+
+    match_frontier()
+            : current_index(0)
+    { }
+
+    static std::vector< std::unique_ptr<match_frontier> > &free_list()
+    {
+        static thread_local std::vector< std::unique_ptr<match_frontier> > frontiers;
+        return frontiers;
+    }
+
+public:
+    // Holds a frontier of the calling thread for the duration of a find, nested finds
+    // (from within a find callback) get a frontier of their own
+    class lease
+    {
+        std::unique_ptr<match_frontier> frontier;
+
+    public:
+        lease()
+        {
+            auto &frontiers = free_list();
+            if(frontiers.empty()) {
+                frontier.reset(new match_frontier());
+            } else {
+                frontier = std::move(frontiers.back());
+                frontiers.pop_back();
+            }
+        }
+
+        lease(lease const &) = delete;
+        lease &operator=(lease const &) = delete;
+
+        ~lease()
+        {
+            frontier->current().clear();
+            frontier->next().clear();
+            free_list().push_back(std::move(frontier));
+        }
+
+        match_frontier *operator->() const { return frontier.get(); }
+    };
+
+    buffer_type &current() { return buffers[current_index]; }
+    buffer_type &next() { return buffers[current_index ^ 1]; }
+
+    // Make the next level the current level, and start with an empty next level
+    void advance()
+    {
+        current_index ^= 1;
+        next().clear();
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_MATCH_FRONTIER_H
@@ -0,0 +1,213 @@
+#ifndef MQTTSUBSCRIPTION_METRICS_H
+#define MQTTSUBSCRIPTION_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Counts values in power of two buckets, bucket 0 counts the value 0 and bucket i the values
+// from 2^(i-1) up to 2^i - 1. The last bucket also counts all larger values.
+template<std::size_t Buckets>
+struct log2_histogram
+{
+    std::array<std::uint64_t, Buckets> buckets{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+
+    static std::size_t bucket(std::uint64_t value)
+    {
+        std::size_t result = 0;
+        while(value != 0) {
+            value >>= 1;
+            ++result;
+        }
+        return std::min(result, Buckets - 1);
+    }
+
+    // The largest value counted in bucket i, except for the last bucket
+    static std::uint64_t upper_bound(std::size_t i) { return (std::uint64_t(1) << i) - 1; }
+
+    void add(std::uint64_t value)
+    {
+        ++buckets[bucket(value)];
+        ++count;
+        sum += value;
+    }
+
+    void merge(log2_histogram const &other)
+    {
+        for(std::size_t i = 0; i < Buckets; ++i)
+            buckets[i] += other.buckets[i];
+        count += other.count;
+        sum += other.sum;
+    }
+
+    // Upper bound of the bucket containing quantile q, 0 without values
+    std::uint64_t quantile(double q) const
+    {
+        std::uint64_t rank = std::uint64_t(q * double(count));
+        std::uint64_t seen = 0;
+        for(std::size_t i = 0; i < Buckets; ++i) {
+            seen += buckets[i];
+            if(seen > rank)
+                return upper_bound(i);
+        }
+        return count == 0 ? 0 : upper_bound(Buckets - 1);
+    }
+};
+
+// The counters of the publishes handled by a thread. Only updated by its own thread, they are
+// added up on the threads when a snapshot is taken.
+struct publish_metrics
+{
+    std::uint64_t messages_in = 0;
+    std::uint64_t bytes_in = 0;
+
+    // Recipients per publish
+    log2_histogram<16> fanout;
+
+    // Nanoseconds to find the subscribers of a topic in the subscription map, publish
+    // topics of which the subscribers are cached are not counted
+    log2_histogram<32> find_latency;
+
+    void merge(publish_metrics const &other)
+    {
+        messages_in += other.messages_in;
+        bytes_in += other.bytes_in;
+        fanout.merge(other.fanout);
+        find_latency.merge(other.find_latency);
+    }
+};
+
+// The publish metrics of the calling thread
+inline publish_metrics &thread_publish_metrics()
+{
+    static thread_local publish_metrics metrics;
+    return metrics;
+}
+
+// The metrics of the broker at one moment, the counters of all threads added up
+struct metrics_snapshot
+{
+    publish_metrics publishes;
+
+    std::uint64_t messages_out = 0;
+    std::uint64_t bytes_out = 0;
+    std::uint64_t dropped = 0;
+    std::uint64_t retransmits = 0;
+
+    // Publishes waiting in the outbound queues of all sessions
+    std::uint64_t queued_messages = 0;
+    std::uint64_t queued_bytes = 0;
+
+    std::uint64_t connected_clients = 0;
+    std::uint64_t sessions = 0;
+    std::uint64_t subscription_nodes = 0;
+    std::uint64_t shared_subscription_groups = 0;
+    std::uint64_t retained_messages = 0;
+
+    // Publishes queued per session
+    log2_histogram<24> session_queue_depth;
+
+    struct value
+    {
+        char const *name;
+        char const *sys_topic;
+        char const *help;
+        bool counter;
+        std::uint64_t value;
+    };
+
+    std::vector<value> values() const
+    {
+        return {
+                { "mqtt_messages_received_total", "$SYS/broker/messages/received", "Publishes received", true, publishes.messages_in },
+                { "mqtt_bytes_received_total", "$SYS/broker/bytes/received", "Topic and payload bytes of the publishes received", true, publishes.bytes_in },
+                { "mqtt_messages_sent_total", "$SYS/broker/messages/sent", "Publishes sent", true, messages_out },
+                { "mqtt_bytes_sent_total", "$SYS/broker/bytes/sent", "Topic and payload bytes of the publishes sent", true, bytes_out },
+                { "mqtt_messages_dropped_total", "$SYS/broker/messages/dropped", "Publishes dropped as a queue was full", true, dropped },
+                { "mqtt_retransmits_total", "$SYS/broker/messages/retransmitted", "Publishes and pubrels sent again", true, retransmits },
+                { "mqtt_queued_messages", "$SYS/broker/messages/queued", "Publishes in the outbound queues", false, queued_messages },
+                { "mqtt_queued_bytes", "$SYS/broker/bytes/queued", "Bytes of the publishes in the outbound queues", false, queued_bytes },
+                { "mqtt_clients_connected", "$SYS/broker/clients/connected", "Connected clients", false, connected_clients },
+                { "mqtt_sessions", "$SYS/broker/clients/total", "Sessions of connected clients and persistent sessions", false, sessions },
+                { "mqtt_subscription_nodes", "$SYS/broker/subscriptions/nodes", "Nodes of the subscription map", false, subscription_nodes },
+                { "mqtt_shared_subscription_groups", "$SYS/broker/subscriptions/shared-groups", "Shared subscription groups", false, shared_subscription_groups },
+                { "mqtt_retained_messages", "$SYS/broker/retained-messages/count", "Retained messages", false, retained_messages },
+        };
+    }
+
+    // Call publish(topic, payload) for every $SYS topic, the histograms are published as quantiles,
+    // the find latency in nanoseconds
+    template<typename F>
+    void for_each_sys_topic(F &&publish) const
+    {
+        for(auto const &v: values())
+            publish(std::string(v.sys_topic), std::to_string(v.value));
+
+        auto quantiles = [&publish](std::string const &topic, auto const &histogram) {
+            publish(topic + "/count", std::to_string(histogram.count));
+            publish(topic + "/p50", std::to_string(histogram.quantile(0.5)));
+            publish(topic + "/p99", std::to_string(histogram.quantile(0.99)));
+        };
+        quantiles("$SYS/broker/publish/fanout", publishes.fanout);
+        quantiles("$SYS/broker/publish/find-latency", publishes.find_latency);
+        quantiles("$SYS/broker/clients/queue-depth", session_queue_depth);
+    }
+
+    // The metrics in the Prometheus text format
+    std::string prometheus_text() const
+    {
+        std::ostringstream out;
+        for(auto const &v: values()) {
+            out << "# HELP " << v.name << " " << v.help << "\n"
+                << "# TYPE " << v.name << " " << (v.counter ? "counter" : "gauge") << "\n"
+                << v.name << " " << v.value << "\n";
+        }
+
+        auto histogram = [&out](char const *name, char const *help, auto const &h) {
+            out << "# HELP " << name << " " << help << "\n"
+                << "# TYPE " << name << " histogram\n";
+            std::uint64_t cumulative = 0;
+            for(std::size_t i = 0; i + 1 < h.buckets.size(); ++i) {
+                cumulative += h.buckets[i];
+                out << name << "_bucket{le=\"" << h.upper_bound(i) << "\"} " << cumulative << "\n";
+            }
+            out << name << "_bucket{le=\"+Inf\"} " << h.count << "\n"
+                << name << "_sum " << h.sum << "\n"
+                << name << "_count " << h.count << "\n";
+        };
+        histogram("mqtt_publish_fanout", "Recipients per publish", publishes.fanout);
+        histogram("mqtt_find_latency_nanoseconds", "Nanoseconds to find the subscribers of a publish topic", publishes.find_latency);
+        histogram("mqtt_session_queue_depth", "Publishes in the outbound queue per session", session_queue_depth);
+        return out.str();
+    }
+
+    // Replace the file at path with the metrics in the Prometheus text format, throws when the
+    // file can not be written. Written to a temporary file first, so a reader never sees a
+    // partial file
+    void write_prometheus_file(std::string const &path) const
+    {
+        std::string text = prometheus_text();
+        std::string temporary = path + ".tmp";
+
+        std::FILE *file = std::fopen(temporary.c_str(), "wb");
+        if(file == nullptr)
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + temporary);
+
+        bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+        if(std::fclose(file) != 0 || !written)
+            throw std::system_error(errno, std::generic_category(), "Failed to write " + temporary);
+
+        std::filesystem::rename(temporary, path);
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_METRICS_H
@@ -0,0 +1,284 @@
+#ifndef MQTTSUBSCRIPTION_OFFLINE_QUEUE_H
+#define MQTTSUBSCRIPTION_OFFLINE_QUEUE_H
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/subscribe_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Limits of the publishes queued for a persistent session while its client is disconnected
+struct offline_limits
+{
+    // Bytes kept in memory, later publishes are written to a segment file
+    std::size_t memory_bytes = 64 * 1024;
+
+    // Bytes queued in memory and on disk, later publishes are dropped
+    std::size_t max_bytes = 64 * 1024 * 1024;
+
+    // Directory of the segment files
+    std::string directory = (std::filesystem::temp_directory_path() / "mqtt_offline").string();
+};
+
+// The publishes for a persistent session of which the client is disconnected, in order. The
+// first publishes are kept in memory, once they exceed the memory budget the publishes are
+// appended to a segment file, so memory per offline session is bounded. Publishes are written
+// and read back sequentially, both in chunks of the memory budget: the records appended are
+// written with one write per chunk, and the publishes read back refer to the chunk they are
+// read into. The segment file is only open while a chunk is written or read, so offline
+// sessions do not hold file descriptors. Not thread safe, used on the thread of the session.
+template<typename Message>
+class offline_queue
+{
+public:
+    typedef std::pair<std::shared_ptr<Message const>, MQTT_NS::qos> entry_type;
+
+private:
+    struct record_header
+    {
+        std::uint8_t qos;
+        std::uint32_t topic_size;
+        std::uint32_t contents_size;
+    };
+
+    offline_limits const *limits;
+
+    std::deque<entry_type> head;
+    std::size_t head_bytes;
+
+    // Publishes in the segment file, after the publishes in memory
+    std::filesystem::path segment_path;
+    bool segment;
+    std::size_t segment_messages;
+    std::size_t segment_bytes;
+
+    // Records appended to the segment which are not written to the file yet
+    std::string write_buffer;
+
+    // Position of the first publish in the segment file which is not read yet
+    std::uint64_t read_offset;
+
+    static std::size_t message_bytes(Message const &message) { return message.topic.size() + message.contents.size(); }
+
+    void open_segment()
+    {
+        // The segment files of brokers sharing the directory are told apart by a random prefix
+        static std::string const prefix = std::to_string(std::random_device()() ^ std::uint32_t(std::chrono::steady_clock::now().time_since_epoch().count()));
+        static std::atomic<std::uint64_t> next_segment{ 0 };
+
+        std::filesystem::create_directories(limits->directory);
+        segment_path = std::filesystem::path(limits->directory) / ("offline." + prefix + "." + std::to_string(next_segment++) + ".seg");
+        std::ofstream file(segment_path, std::ios::binary | std::ios::trunc);
+        if(!file)
+            throw std::runtime_error("Failed to open " + segment_path.string());
+        segment = true;
+    }
+
+    void close_segment()
+    {
+        if(!segment)
+            return;
+
+        std::error_code ec;
+        std::filesystem::remove(segment_path, ec);
+        segment = false;
+        segment_messages = 0;
+        segment_bytes = 0;
+        write_buffer.clear();
+        read_offset = 0;
+    }
+
+    void write_segment()
+    {
+        if(write_buffer.empty())
+            return;
+
+        std::ofstream file(segment_path, std::ios::binary | std::ios::app);
+        if(!file.write(write_buffer.data(), static_cast<std::streamsize>(write_buffer.size())) || !file.flush())
+            throw std::runtime_error("Failed to write " + segment_path.string());
+        write_buffer.clear();
+    }
+
+    // Read size bytes at read_offset into a new chunk, returns the bytes read
+    std::size_t read_segment(std::shared_ptr<char[]> &chunk, std::size_t size)
+    {
+        std::ifstream file(segment_path, std::ios::binary);
+        if(!file.seekg(static_cast<std::streamoff>(read_offset)))
+            throw std::runtime_error("Failed to read " + segment_path.string());
+
+        chunk.reset(new char[size]);
+        file.read(chunk.get(), static_cast<std::streamsize>(size));
+        if(file.bad())
+            throw std::runtime_error("Failed to read " + segment_path.string());
+        return static_cast<std::size_t>(file.gcount());
+    }
+
+    // Read the next chunk of publishes from the segment into memory, at least one publish
+    void read_chunk()
+    {
+        write_segment();
+
+        std::shared_ptr<char[]> chunk;
+        std::size_t size = read_segment(chunk, std::max(limits->memory_bytes, sizeof(record_header)));
+
+        // A publish larger than the memory budget is read by itself
+        record_header header;
+        if(size < sizeof(header))
+            throw std::runtime_error("Truncated segment " + segment_path.string());
+        std::memcpy(&header, chunk.get(), sizeof(header));
+        std::size_t first_size = sizeof(header) + std::size_t(header.topic_size) + header.contents_size;
+        if(first_size > size) {
+            size = read_segment(chunk, first_size);
+            if(size != first_size)
+                throw std::runtime_error("Truncated segment " + segment_path.string());
+        }
+
+        MQTT_NS::const_shared_ptr_array life(chunk, chunk.get());
+        std::size_t offset = 0;
+        while(segment_messages != 0 && size - offset >= sizeof(header)) {
+            std::memcpy(&header, chunk.get() + offset, sizeof(header));
+            std::size_t bytes = std::size_t(header.topic_size) + header.contents_size;
+            if(size - offset - sizeof(header) < bytes)
+                break;
+
+            char const *topic = chunk.get() + offset + sizeof(header);
+            auto message = std::make_shared<Message const>(Message{ MQTT_NS::buffer(MQTT_NS::string_view(topic, header.topic_size), life),
+                                                                    MQTT_NS::buffer(MQTT_NS::string_view(topic + header.topic_size, header.contents_size), life) });
+            head.emplace_back(std::move(message), MQTT_NS::qos(header.qos));
+            head_bytes += bytes;
+
+            --segment_messages;
+            segment_bytes -= bytes;
+            offset += sizeof(header) + bytes;
+        }
+        read_offset += offset;
+    }
+
+public:
+    explicit offline_queue(offline_limits const &_limits)
+            : limits(&_limits), head_bytes(0), segment(false), segment_messages(0), segment_bytes(0), read_offset(0)
+    { }
+
+    offline_queue(offline_queue &&other) noexcept
+            : limits(other.limits), head(std::move(other.head)), head_bytes(other.head_bytes), segment_path(std::move(other.segment_path)),
+              segment(other.segment), segment_messages(other.segment_messages), segment_bytes(other.segment_bytes),
+              write_buffer(std::move(other.write_buffer)), read_offset(other.read_offset)
+    {
+        other.head.clear();
+        other.head_bytes = 0;
+        other.segment = false;
+        other.segment_messages = 0;
+        other.segment_bytes = 0;
+    }
+
+    offline_queue &operator=(offline_queue &&other) noexcept
+    {
+        if(this != &other) {
+            close_segment();
+            limits = other.limits;
+            head = std::move(other.head);
+            head_bytes = other.head_bytes;
+            segment_path = std::move(other.segment_path);
+            segment = other.segment;
+            segment_messages = other.segment_messages;
+            segment_bytes = other.segment_bytes;
+            write_buffer = std::move(other.write_buffer);
+            read_offset = other.read_offset;
+
+            other.head.clear();
+            other.head_bytes = 0;
+            other.segment = false;
+            other.segment_messages = 0;
+            other.segment_bytes = 0;
+        }
+        return *this;
+    }
+
+    offline_queue(offline_queue const &) = delete;
+    offline_queue &operator=(offline_queue const &) = delete;
+
+    ~offline_queue()
+    {
+        close_segment();
+    }
+
+    // Append a publish, returns false when it is dropped because the queue is full. Throws when
+    // the segment file can not be written
+    bool push(std::shared_ptr<Message const> const &message, MQTT_NS::qos qos)
+    {
+        std::size_t bytes = message_bytes(*message);
+        if(head_bytes + segment_bytes + bytes > limits->max_bytes)
+            return false;
+
+        if(!segment && head_bytes + bytes <= limits->memory_bytes) {
+            head.emplace_back(message, qos);
+            head_bytes += bytes;
+            return true;
+        }
+
+        if(!segment)
+            open_segment();
+
+        record_header header{ static_cast<std::uint8_t>(qos), static_cast<std::uint32_t>(message->topic.size()),
+                              static_cast<std::uint32_t>(message->contents.size()) };
+        write_buffer.append(reinterpret_cast<char const *>(&header), sizeof(header));
+        write_buffer.append(message->topic.data(), message->topic.size());
+        write_buffer.append(message->contents.data(), message->contents.size());
+        if(write_buffer.size() >= limits->memory_bytes)
+            write_segment();
+
+        ++segment_messages;
+        segment_bytes += bytes;
+        return true;
+    }
+
+    // Remove at most max_count publishes from the front, in order, and call f(entry_type &&) for
+    // every publish. Returns the number of publishes removed
+    template<typename F>
+    std::size_t pop(std::size_t max_count, F &&f)
+    {
+        std::size_t count = 0;
+        for(; count < max_count && !head.empty(); ++count) {
+            entry_type e = std::move(head.front());
+            head.pop_front();
+            head_bytes -= message_bytes(*e.first);
+            f(std::move(e));
+        }
+
+        if(count == max_count || !segment)
+            return count;
+
+        // Once the memory is empty the next chunk of the segment is read into memory
+        read_chunk();
+
+        if(segment_messages == 0)
+            close_segment();
+
+        return count + pop(max_count - count, f);
+    }
+
+    // Drop all publishes
+    void clear()
+    {
+        head.clear();
+        head_bytes = 0;
+        close_segment();
+    }
+
+    bool empty() const { return head.empty() && segment_messages == 0; }
+    std::size_t size() const { return head.size() + segment_messages; }
+    std::size_t bytes() const { return head_bytes + segment_bytes; }
+};
+
+#endif //MQTTSUBSCRIPTION_OFFLINE_QUEUE_H
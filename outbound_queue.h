@@ -0,0 +1,126 @@
+#ifndef MQTTSUBSCRIPTION_OUTBOUND_QUEUE_H
+#define MQTTSUBSCRIPTION_OUTBOUND_QUEUE_H
+
+#include <mqtt/string_view.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// What a session does with a publish which does not fit in its outbound queue
+enum class slow_consumer_policy
+{
+    // Drop the oldest QoS 0 publish which is not handed to the connection yet, or the new
+    // publish when there is none
+    drop_oldest_qos0,
+    drop_newest,
+    disconnect
+};
+
+static inline char const *slow_consumer_policy_name(slow_consumer_policy policy)
+{
+    switch(policy) {
+        case slow_consumer_policy::drop_oldest_qos0: return "drop-oldest-qos0";
+        case slow_consumer_policy::drop_newest: return "drop-newest";
+        case slow_consumer_policy::disconnect: return "disconnect";
+    }
+    return "unknown";
+}
+
+static inline slow_consumer_policy slow_consumer_policy_from_name(MQTT_NS::string_view const &name)
+{
+    for(int i = int(slow_consumer_policy::drop_oldest_qos0); i <= int(slow_consumer_policy::disconnect); ++i)
+        if(name == slow_consumer_policy_name(slow_consumer_policy(i)))
+            return slow_consumer_policy(i);
+    throw std::runtime_error(std::string("Unknown slow consumer policy: ").append(name.data(), name.size()));
+}
+
+// Limits of the publishes queued by a session, from the publish until the write completes
+struct outbound_limits
+{
+    // Bytes of publishes handed to the connection at once
+    std::size_t max_batch_bytes = 64 * 1024;
+
+    // Time to wait for more publishes before a batch is handed to the connection, 0 hands the
+    // batch over at the end of the event loop iteration
+    std::chrono::microseconds max_batch_delay{ 0 };
+
+    std::size_t max_queued_messages = 10000;
+    std::size_t max_queued_bytes = 16 * 1024 * 1024;
+
+    slow_consumer_policy policy = slow_consumer_policy::drop_oldest_qos0;
+
+    // QoS 1 and 2 publishes sent to a client and not acknowledged yet, later publishes wait in
+    // the queue until an acknowledgement arrives
+    std::size_t receive_maximum = 32;
+
+    // Time after which a publish or pubrel which is not acknowledged is sent again
+    std::chrono::milliseconds retransmit_interval{ 20000 };
+};
+
+// Outbound statistics of the sessions of a thread
+struct outbound_statistics
+{
+    // Batches of publishes handed to the connections
+    std::uint64_t batches = 0;
+    std::uint64_t messages = 0;
+    std::uint64_t bytes = 0;
+
+    // Batches by number of messages: 1, 2-3, 4-7, ..., 128 and more
+    std::array<std::uint64_t, 8> histogram{};
+
+    // Publishes queued by all sessions of the thread, and the highest number of bytes queued
+    std::uint64_t queued_messages = 0;
+    std::uint64_t queued_bytes = 0;
+    std::uint64_t max_queued_bytes = 0;
+
+    std::uint64_t dropped_oldest = 0;
+    std::uint64_t dropped_newest = 0;
+    std::uint64_t disconnects = 0;
+
+    // Publishes for disconnected clients dropped as their offline queue is full
+    std::uint64_t dropped_offline = 0;
+
+    // Publishes and pubrels sent again as they were not acknowledged in time
+    std::uint64_t retransmits = 0;
+
+    // Batches which stopped at a QoS 1 or 2 publish as the in-flight window was full
+    std::uint64_t window_full = 0;
+
+    void add_batch(std::size_t batch_messages, std::size_t batch_bytes)
+    {
+        ++batches;
+        messages += batch_messages;
+        bytes += batch_bytes;
+
+        std::size_t bucket = 0;
+        while(batch_messages >>= 1)
+            ++bucket;
+        ++histogram[std::min(bucket, histogram.size() - 1)];
+    }
+
+    void queued(std::size_t message_bytes)
+    {
+        ++queued_messages;
+        queued_bytes += message_bytes;
+        max_queued_bytes = std::max(max_queued_bytes, queued_bytes);
+    }
+
+    void dequeued(std::size_t message_bytes)
+    {
+        --queued_messages;
+        queued_bytes -= message_bytes;
+    }
+};
+
+// The statistics of the sessions running on the calling thread
+inline outbound_statistics &thread_outbound_statistics()
+{
+    static thread_local outbound_statistics stats;
+    return stats;
+}
+
+#endif //MQTTSUBSCRIPTION_OUTBOUND_QUEUE_H
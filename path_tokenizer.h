@@ -5,13 +5,95 @@
 #ifndef MQTTSUBSCRIPTION_PATH_TOKENIZER_H
 #define MQTTSUBSCRIPTION_PATH_TOKENIZER_H
 
-#include <boost/tokenizer.hpp>
-#include <boost/functional/hash.hpp>
+#include <mqtt/string_view.hpp>
 
-static inline boost::tokenizer< boost::char_separator<char> > mqtt_path_tokenizer(MQTT_NS::string_view const &path)
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+
+static constexpr char mqtt_path_separator = '/';
+
+// Splits a topic (filter) into its levels. The levels are returned as string_views
+// into the original path, so no memory is allocated while iterating. Empty levels
+// are kept, an empty path results in no levels at all.
+class mqtt_path_tokens
+{
+    MQTT_NS::string_view path;
+
+public:
+    class const_iterator
+    {
+        MQTT_NS::string_view path;
+        MQTT_NS::string_view::size_type begin_pos;
+        MQTT_NS::string_view::size_type end_pos;
+
+        void find_end()
+        {
+            end_pos = path.find(mqtt_path_separator, begin_pos);
+            if(end_pos == MQTT_NS::string_view::npos)
+                end_pos = path.size();
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef MQTT_NS::string_view value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef MQTT_NS::string_view const *pointer;
+        typedef MQTT_NS::string_view reference;
+
+        // End iterator
+        const_iterator()
+                : begin_pos(MQTT_NS::string_view::npos), end_pos(MQTT_NS::string_view::npos)
+        { }
+
+        explicit const_iterator(MQTT_NS::string_view const &_path)
+                : path(_path), begin_pos(0), end_pos(0)
+        {
+            if(path.empty())
+                begin_pos = end_pos = MQTT_NS::string_view::npos;
+            else
+                find_end();
+        }
+
+        MQTT_NS::string_view operator*() const { return path.substr(begin_pos, end_pos - begin_pos); }
+
+        const_iterator &operator++()
+        {
+            if(end_pos == path.size()) {
+                begin_pos = end_pos = MQTT_NS::string_view::npos;
+            } else {
+                begin_pos = end_pos + 1;
+                find_end();
+            }
+
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator result = *this;
+            ++(*this);
+            return result;
+        }
+
+        bool operator==(const_iterator const &other) const { return begin_pos == other.begin_pos; }
+        bool operator!=(const_iterator const &other) const { return begin_pos != other.begin_pos; }
+    };
+
+    typedef const_iterator iterator;
+
+    explicit mqtt_path_tokens(MQTT_NS::string_view const &_path)
+            : path(_path)
+    { }
+
+    const_iterator begin() const { return const_iterator(path); }
+    const_iterator end() const { return const_iterator(); }
+};
+
+static inline mqtt_path_tokens mqtt_path_tokenizer(MQTT_NS::string_view const &path)
 {
-    static boost::char_separator<char> mqtt_path_separator("/",  "", boost::keep_empty_tokens);
-    return boost::tokenizer< boost::char_separator<char> >(path, mqtt_path_separator);
+    return mqtt_path_tokens(path);
 }
 
 #endif //MQTTSUBSCRIPTION_PATH_TOKENIZER_H
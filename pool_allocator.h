@@ -0,0 +1,177 @@
+#ifndef MQTTSUBSCRIPTION_POOL_ALLOCATOR_H
+#define MQTTSUBSCRIPTION_POOL_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+// Fixed size blocks carved from 64 KiB slabs, for the nodes of the topic maps. Every thread
+// keeps freed blocks in a cache of its own, so allocating and freeing nodes takes no lock.
+// A cache that grows beyond cache_limit returns half of its blocks to the shared free list,
+// an empty cache takes a batch from it. Slabs are never returned to the system, memory of
+// removed nodes is reused by the next inserts.
+template<std::size_t BlockSize>
+class block_pool
+{
+    static_assert(BlockSize >= sizeof(void *), "Block too small to link");
+
+    struct block
+    {
+        block *next;
+    };
+
+    enum : std::size_t
+    {
+        slab_size = 64 * 1024,
+        blocks_per_slab = slab_size / BlockSize,
+        cache_limit = 1024,
+        batch_size = cache_limit / 2
+    };
+
+    struct free_list
+    {
+        block *head = nullptr;
+        std::size_t count = 0;
+
+        void push(block *b)
+        {
+            b->next = head;
+            head = b;
+            ++count;
+        }
+
+        block *pop()
+        {
+            block *b = head;
+            head = b->next;
+            --count;
+            return b;
+        }
+
+        // Move at most n blocks to other
+        void move(free_list &other, std::size_t n)
+        {
+            while(n-- != 0 && head != nullptr)
+                other.push(pop());
+        }
+    };
+
+    std::mutex mutex;
+    free_list shared;
+    std::atomic<std::size_t> slabs{ 0 };
+
+    // Never destroyed, threads return the blocks of their cache to it when they exit
+    static block_pool &instance()
+    {
+        static block_pool *pool = new block_pool();
+        return *pool;
+    }
+
+    struct thread_cache
+        : free_list
+    {
+        ~thread_cache()
+        {
+            block_pool &pool = instance();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            this->move(pool.shared, this->count);
+        }
+    };
+
+    static thread_cache &cache()
+    {
+        static thread_local thread_cache c;
+        return c;
+    }
+
+    // Fill an empty cache from the shared free list, or from a new slab
+    void refill(free_list &c)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shared.move(c, batch_size);
+        }
+        if(c.head != nullptr)
+            return;
+
+        char *slab = static_cast<char *>(::operator new(slab_size));
+        ++slabs;
+        for(std::size_t i = 0; i < blocks_per_slab; ++i)
+            c.push(reinterpret_cast<block *>(slab + i * BlockSize));
+    }
+
+public:
+    static void *allocate()
+    {
+        thread_cache &c = cache();
+        if(c.head == nullptr)
+            instance().refill(c);
+        return c.pop();
+    }
+
+    static void deallocate(void *p) noexcept
+    {
+        thread_cache &c = cache();
+        c.push(static_cast<block *>(p));
+
+        if(c.count > cache_limit) {
+            block_pool &pool = instance();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            c.move(pool.shared, batch_size);
+        }
+    }
+
+    // Return the number of bytes taken from the system for blocks of this size
+    static std::size_t reserved_bytes() { return instance().slabs * std::size_t(slab_size); }
+};
+
+// Allocator for the nodes of the topic maps, single objects come from a block_pool sized for
+// the object, arrays (hash buckets, vectors) are allocated with operator new. Stateless, all
+// instances are equal.
+template<typename T>
+class pool_allocator
+{
+    // Round up to the alignment of the slabs, so every block in a slab is aligned. A function,
+    // as the allocator may be instantiated for void before it is rebound to the node type
+    static constexpr std::size_t block_size()
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned types are not supported");
+        return (sizeof(T) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+    }
+
+public:
+    typedef T value_type;
+
+    pool_allocator() noexcept = default;
+
+    template<typename U>
+    pool_allocator(pool_allocator<U> const &) noexcept
+    { }
+
+    T *allocate(std::size_t n)
+    {
+        if(n == 1)
+            return static_cast<T *>(block_pool<block_size()>::allocate());
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        if(n == 1)
+            block_pool<block_size()>::deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    // Return the number of bytes taken from the system for single objects of type T
+    static std::size_t reserved_bytes() { return block_pool<block_size()>::reserved_bytes(); }
+
+    template<typename U>
+    bool operator==(pool_allocator<U> const &) const noexcept { return true; }
+
+    template<typename U>
+    bool operator!=(pool_allocator<U> const &) const noexcept { return false; }
+};
+
+#endif //MQTTSUBSCRIPTION_POOL_ALLOCATOR_H
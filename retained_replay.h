@@ -0,0 +1,78 @@
+#ifndef MQTTSUBSCRIPTION_RETAINED_REPLAY_H
+#define MQTTSUBSCRIPTION_RETAINED_REPLAY_H
+
+#include "mqtt_server_cpp.hpp"
+
+#include <algorithm>
+#include <memory>
+
+#include "retained_topic_map.h"
+#include "concurrent_topic_map.h"
+#include "pool_allocator.h"
+#include "session.h"
+
+struct retained_message
+{
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+    MQTT_NS::qos qos;
+};
+
+using retained_map_t = concurrent_topic_map< retained_topic_map<retained_message, pool_allocator<retained_message> > >;
+
+// Sends the retained messages matching a new subscription to a session. The messages are sent in
+// batches, after every batch the replay yields to the other connections of the thread and waits
+// until the send queue of the session is below max_queued. Runs on the thread of the session.
+//
+// The waiting replay is held by the session, so the replay only refers to the session weakly.
+class retained_replay
+        : public std::enable_shared_from_this<retained_replay>
+{
+    retained_map_t &retained_map;
+    session_weak_ptr_t session;
+    retained_map_t::map_type::cursor cursor;
+    MQTT_NS::qos qos;
+    std::size_t batch_size;
+    std::size_t max_queued;
+
+    void step()
+    {
+        // Stop when the connection is closed
+        auto target = session.lock();
+        if(!target || target->closed || target->con.expired())
+            return;
+
+        retained_map.read([this, &target](auto const &map) {
+            map.find_next(cursor, batch_size, [this, &target](retained_message const &message) {
+                target->publish(message.topic, message.contents, std::min(qos, message.qos) | MQTT_NS::retain::yes);
+            });
+        });
+
+        if(cursor.done())
+            return;
+
+        target->when_writable(max_queued, [self = shared_from_this()] {
+            self->step();
+        });
+    }
+
+public:
+    retained_replay(retained_map_t &_retained_map, session_ptr_t const &_session, MQTT_NS::string_view const &topic_filter,
+                    MQTT_NS::qos _qos, std::size_t _batch_size, std::size_t _max_queued)
+            : retained_map(_retained_map), session(_session),
+              cursor(retained_map.read([&topic_filter](auto const &map) { return map.find_cursor(topic_filter); })),
+              qos(_qos), batch_size(std::max<std::size_t>(_batch_size, 1)), max_queued(_max_queued)
+    { }
+
+    // Start sending the retained messages matching topic_filter to session
+    static void start(retained_map_t &retained_map, session_ptr_t const &session, MQTT_NS::string_view const &topic_filter,
+                      MQTT_NS::qos qos, std::size_t batch_size, std::size_t max_queued)
+    {
+        auto replay = std::make_shared<retained_replay>(retained_map, session, topic_filter, qos, batch_size, max_queued);
+        boost::asio::post(*session->ioc, [replay] {
+            replay->step();
+        });
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_RETAINED_REPLAY_H
@@ -0,0 +1,503 @@
+#ifndef MQTTSUBSCRIPTION_RETAINED_STORE_H
+#define MQTTSUBSCRIPTION_RETAINED_STORE_H
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/subscribe_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+#ifdef _WIN32
+
+// The store writes its files with POSIX calls and maps the snapshot with mmap, which are not
+// available on Windows. The broker does not start when a store directory is configured.
+class retained_store
+{
+public:
+    retained_store(std::string const &, std::chrono::milliseconds, std::size_t)
+    {
+        throw std::runtime_error("The retained store is not supported on Windows");
+    }
+
+    template<typename ConcurrentMap>
+    void load(ConcurrentMap &) { }
+
+    template<typename ConcurrentMap>
+    void start(ConcurrentMap &) { }
+
+    void update(MQTT_NS::string_view const &, MQTT_NS::string_view const &, MQTT_NS::qos) { }
+    void remove(MQTT_NS::string_view const &) { }
+};
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+
+// Durable storage of the retained messages. Every update and removal is appended to a log,
+// a writer thread writes the appended records and syncs the log at most once per sync interval,
+// so concurrent publishes share a single fsync. Once the log grows beyond compact_bytes, the
+// retained messages are written to a snapshot and the logs it contains are deleted.
+//
+// On startup the snapshot is memory mapped and the retained messages refer to the mapped
+// contents, only the topics are parsed to build the map. The logs written after the snapshot
+// are replayed on top of it.
+//
+// Files in the directory:
+//   retained.snapshot   header { magic, version, first log } followed by update records
+//   retained.<n>.log    records, appended in order
+// A record is { crc32, type, qos, reserved, topic size, contents size, topic, contents }, with
+// the crc over everything after it. Records are stored in the byte order of the machine.
+class retained_store
+{
+    enum : std::uint8_t { record_update = 1, record_remove = 2 };
+
+    struct record_header
+    {
+        std::uint32_t crc;
+        std::uint8_t type;
+        std::uint8_t qos;
+        std::uint16_t reserved;
+        std::uint32_t topic_size;
+        std::uint32_t contents_size;
+    };
+
+    struct snapshot_header
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint64_t first_log;
+    };
+
+    static constexpr char snapshot_magic[4] = { 'M', 'Q', 'R', 'S' };
+    static constexpr std::uint32_t snapshot_version = 1;
+
+    // Records appended while the log is being written wake up the writer once they exceed this
+    static constexpr std::size_t flush_bytes = 1024 * 1024;
+
+    // Retained messages copied from the map per read lock while writing a snapshot
+    static constexpr std::size_t snapshot_batch = 4096;
+
+    // A memory mapped snapshot, unmapped once no retained message refers to it anymore
+    struct mapping
+    {
+        char const *data = nullptr;
+        std::size_t size = 0;
+
+        ~mapping()
+        {
+            if(data != nullptr)
+                ::munmap(const_cast<char *>(data), size);
+        }
+    };
+
+    std::filesystem::path directory;
+    std::chrono::milliseconds sync_interval;
+    std::size_t compact_bytes;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    // Records appended and not written yet
+    std::string pending;
+    bool stopping;
+
+    // Only used by the writer thread after start
+    int log_fd;
+    std::uint64_t log_number;
+    std::size_t log_bytes;
+
+    std::thread writer;
+
+    std::filesystem::path log_path(std::uint64_t number) const
+    {
+        return directory / ("retained." + std::to_string(number) + ".log");
+    }
+
+    std::filesystem::path snapshot_path() const { return directory / "retained.snapshot"; }
+
+    static std::runtime_error error(std::string const &what, std::filesystem::path const &path)
+    {
+        return std::runtime_error(what + " " + path.string() + ": " + std::strerror(errno));
+    }
+
+    static void append_record(std::string &out, std::uint8_t type, MQTT_NS::qos qos, MQTT_NS::string_view const &topic,
+                              MQTT_NS::string_view const &contents)
+    {
+        record_header header{ 0, type, static_cast<std::uint8_t>(qos), 0,
+                              static_cast<std::uint32_t>(topic.size()), static_cast<std::uint32_t>(contents.size()) };
+
+        boost::crc_32_type crc;
+        crc.process_bytes(&header.type, sizeof(header) - sizeof(header.crc));
+        crc.process_bytes(topic.data(), topic.size());
+        crc.process_bytes(contents.data(), contents.size());
+        header.crc = crc.checksum();
+
+        out.append(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.append(topic.data(), topic.size());
+        out.append(contents.data(), contents.size());
+    }
+
+    static void write_all(int fd, char const *data, std::size_t size, std::filesystem::path const &path)
+    {
+        while(size != 0) {
+            ssize_t n = ::write(fd, data, size);
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                throw error("Failed to write", path);
+            }
+            data += n;
+            size -= static_cast<std::size_t>(n);
+        }
+    }
+
+    static void sync_directory(std::filesystem::path const &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    void open_log(std::uint64_t number)
+    {
+        log_number = number;
+        log_bytes = 0;
+        log_fd = ::open(log_path(number).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(log_fd < 0)
+            throw error("Failed to open", log_path(number));
+        sync_directory(directory);
+    }
+
+    // Write records to the log and sync it
+    void write_log(std::string const &records)
+    {
+        if(records.empty())
+            return;
+
+        write_all(log_fd, records.data(), records.size(), log_path(log_number));
+        if(::fdatasync(log_fd) != 0)
+            throw error("Failed to sync", log_path(log_number));
+        log_bytes += records.size();
+    }
+
+    // Call f(header, topic, contents, life) for the records in data, stops at the first incomplete
+    // or corrupt record. Returns the number of bytes of complete records
+    template<typename F>
+    static std::size_t parse_records(char const *data, std::size_t size, bool check_crc, F &&f)
+    {
+        std::size_t offset = 0;
+        while(size - offset >= sizeof(record_header)) {
+            record_header header;
+            std::memcpy(&header, data + offset, sizeof(header));
+
+            std::size_t record_size = sizeof(header) + std::size_t(header.topic_size) + header.contents_size;
+            if(size - offset < record_size)
+                break;
+
+            char const *topic = data + offset + sizeof(header);
+            char const *contents = topic + header.topic_size;
+            if(check_crc) {
+                boost::crc_32_type crc;
+                crc.process_bytes(data + offset + sizeof(header.crc), record_size - sizeof(header.crc));
+                if(crc.checksum() != header.crc)
+                    break;
+            }
+
+            f(header, MQTT_NS::string_view(topic, header.topic_size), MQTT_NS::string_view(contents, header.contents_size));
+            offset += record_size;
+        }
+        return offset;
+    }
+
+    // Apply the records of a log to map, the retained messages refer to a copy of the log in memory
+    template<typename Map>
+    void replay_log(std::filesystem::path const &path, Map &map)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw error("Failed to open", path);
+
+        struct stat st;
+        ::fstat(fd, &st);
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+
+        std::shared_ptr<char[]> data(new char[std::max<std::size_t>(size, 1)]);
+        std::size_t read = 0;
+        while(read < size) {
+            ssize_t n = ::read(fd, data.get() + read, size - read);
+            if(n <= 0)
+                break;
+            read += static_cast<std::size_t>(n);
+        }
+        ::close(fd);
+
+        MQTT_NS::const_shared_ptr_array life(data, data.get());
+        std::size_t parsed = parse_records(data.get(), read, true, [&map, &life](record_header const &header,
+                MQTT_NS::string_view const &topic, MQTT_NS::string_view const &contents) {
+            if(header.type == record_remove)
+                map.remove(topic);
+            else
+                map.insert_or_update(topic, { MQTT_NS::buffer(topic, life), MQTT_NS::buffer(contents, life), MQTT_NS::qos(header.qos) });
+        });
+
+        if(parsed != size)
+            BROKER_LOG(warning, "Retained log " << path.string() << " ends with an incomplete record at " << parsed << " of " << size << " bytes");
+    }
+
+    // Write the retained messages of map to a new snapshot, which contains the logs from first_log.
+    // The map is read in batches, messages modified meanwhile are also in the logs from first_log.
+    template<typename ConcurrentMap>
+    void write_snapshot(ConcurrentMap &map, std::uint64_t first_log)
+    {
+        std::filesystem::path temporary = directory / "retained.snapshot.tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            throw error("Failed to open", temporary);
+
+        try {
+            snapshot_header header;
+            std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+            header.version = snapshot_version;
+            header.first_log = first_log;
+
+            std::string out(reinterpret_cast<char const *>(&header), sizeof(header));
+
+            std::size_t position = 0;
+            for(bool done = false; !done; ) {
+                map.read([&out, &position, &done](auto const &m) {
+                    position = m.for_each(position, snapshot_batch, [&out](auto const &message) {
+                        append_record(out, record_update, message.qos, message.topic, message.contents);
+                    });
+                    done = position >= m.end_position();
+                });
+
+                if(out.size() >= flush_bytes || done) {
+                    write_all(fd, out.data(), out.size(), temporary);
+                    out.clear();
+                }
+            }
+
+            if(::fsync(fd) != 0)
+                throw error("Failed to sync", temporary);
+        } catch(...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+
+        std::filesystem::rename(temporary, snapshot_path());
+        sync_directory(directory);
+    }
+
+    // Start a new log, write a snapshot which contains it and delete the older logs.
+    // Runs on the writer thread
+    template<typename ConcurrentMap>
+    void compact(ConcurrentMap &map)
+    {
+        std::uint64_t first_log = log_number + 1;
+
+        // Records are appended under the exclusive lock of the map, so the records pending while
+        // the read lock is held are the last records of the old log, and the map contains them.
+        // Records appended later are written by the writer thread after the new log is opened
+        std::string records;
+        map.read([this, &records](auto const &) {
+            std::lock_guard<std::mutex> lock(mutex);
+            records.swap(pending);
+        });
+
+        write_log(records);
+        ::close(log_fd);
+        open_log(first_log);
+
+        write_snapshot(map, first_log);
+
+        for(auto const &entry: std::filesystem::directory_iterator(directory)) {
+            std::uint64_t number;
+            if(parse_log_name(entry.path(), number) && number < first_log)
+                std::filesystem::remove(entry.path());
+        }
+
+        BROKER_LOG(info, "Retained store compacted, snapshot of " << std::filesystem::file_size(snapshot_path()) << " bytes");
+    }
+
+    static bool parse_log_name(std::filesystem::path const &path, std::uint64_t &number)
+    {
+        std::string name = path.filename().string();
+        if(name.size() <= 13 || name.compare(0, 9, "retained.") != 0 || name.compare(name.size() - 4, 4, ".log") != 0)
+            return false;
+
+        std::string digits = name.substr(9, name.size() - 13);
+        if(digits.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        number = std::stoull(digits);
+        return true;
+    }
+
+public:
+    retained_store(std::string const &_directory, std::chrono::milliseconds _sync_interval, std::size_t _compact_bytes)
+            : directory(_directory), sync_interval(_sync_interval), compact_bytes(_compact_bytes), stopping(false),
+              log_fd(-1), log_number(0), log_bytes(0)
+    {
+        std::filesystem::create_directories(directory);
+    }
+
+    retained_store(retained_store const &) = delete;
+    retained_store &operator=(retained_store const &) = delete;
+
+    // Write the remaining records and stop the writer
+    ~retained_store()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+
+        if(writer.joinable())
+            writer.join();
+        if(log_fd >= 0)
+            ::close(log_fd);
+    }
+
+    // Load the snapshot and the logs into an empty map, and open a new log. Throws when the
+    // snapshot or a log can not be read
+    template<typename ConcurrentMap>
+    void load(ConcurrentMap &map)
+    {
+        std::uint64_t first_log = 0;
+
+        map.modify([this, &first_log](auto &m) {
+            int fd = ::open(snapshot_path().c_str(), O_RDONLY);
+            if(fd >= 0) {
+                struct stat st;
+                ::fstat(fd, &st);
+
+                auto snapshot = std::make_shared<mapping>();
+                snapshot->size = static_cast<std::size_t>(st.st_size);
+                void *data = snapshot->size == 0 ? MAP_FAILED : ::mmap(nullptr, snapshot->size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+                if(data == MAP_FAILED)
+                    throw error("Failed to map", snapshot_path());
+                snapshot->data = static_cast<char const *>(data);
+
+                snapshot_header header;
+                if(snapshot->size < sizeof(header))
+                    throw std::runtime_error("Retained snapshot too small: " + snapshot_path().string());
+                std::memcpy(&header, snapshot->data, sizeof(header));
+                if(std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 || header.version != snapshot_version)
+                    throw std::runtime_error("Unknown retained snapshot format: " + snapshot_path().string());
+                first_log = header.first_log;
+
+                // The snapshot is synced before it is renamed, so the records are not checked again
+                ::madvise(data, snapshot->size, MADV_SEQUENTIAL);
+                std::size_t count = 0;
+                parse_records(snapshot->data + sizeof(header), snapshot->size - sizeof(header), false, [&m, &snapshot, &count](
+                        record_header const &record, MQTT_NS::string_view const &topic, MQTT_NS::string_view const &contents) {
+                    MQTT_NS::const_shared_ptr_array life(snapshot, snapshot->data);
+                    m.insert_or_update(topic, { MQTT_NS::buffer(topic, life), MQTT_NS::buffer(contents, life), MQTT_NS::qos(record.qos) });
+                    ++count;
+                });
+
+                BROKER_LOG(info, "Retained snapshot loaded, " << count << " messages");
+            }
+
+            std::vector<std::uint64_t> logs;
+            for(auto const &entry: std::filesystem::directory_iterator(directory)) {
+                std::uint64_t number;
+                if(parse_log_name(entry.path(), number) && number >= first_log)
+                    logs.push_back(number);
+            }
+            std::sort(logs.begin(), logs.end());
+
+            for(auto number: logs)
+                replay_log(log_path(number), m);
+
+            BROKER_LOG(info, "Retained store loaded, " << logs.size() << " logs replayed, " << m.values() << " messages");
+            open_log(logs.empty() ? first_log : logs.back() + 1);
+        });
+    }
+
+    // Start the writer thread, which also compacts the logs into a snapshot of map
+    template<typename ConcurrentMap>
+    void start(ConcurrentMap &map)
+    {
+        writer = std::thread([this, &map] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while(!stopping) {
+                wakeup.wait_for(lock, sync_interval, [this] { return stopping || pending.size() >= flush_bytes; });
+
+                std::string records;
+                records.swap(pending);
+                lock.unlock();
+
+                try {
+                    write_log(records);
+                    if(log_bytes >= compact_bytes)
+                        compact(map);
+                } catch(std::exception &e) {
+                    BROKER_LOG(error, "Retained store: " << e.what());
+                }
+
+                lock.lock();
+            }
+
+            try {
+                write_log(pending);
+                pending.clear();
+            } catch(std::exception &e) {
+                BROKER_LOG(error, "Retained store: " << e.what());
+            }
+        });
+    }
+
+    // Append the update of a retained message. Should be called under the exclusive lock of the
+    // map, in the same order as the map is modified
+    void update(MQTT_NS::string_view const &topic, MQTT_NS::string_view const &contents, MQTT_NS::qos qos)
+    {
+        bool flush;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            append_record(pending, record_update, qos, topic, contents);
+            flush = pending.size() >= flush_bytes;
+        }
+        if(flush)
+            wakeup.notify_one();
+    }
+
+    // Append the removal of a retained message, see update
+    void remove(MQTT_NS::string_view const &topic)
+    {
+        bool flush;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            append_record(pending, record_remove, MQTT_NS::qos::at_most_once, topic, MQTT_NS::string_view());
+            flush = pending.size() >= flush_bytes;
+        }
+        if(flush)
+            wakeup.notify_one();
+    }
+};
+
+#endif //_WIN32
+
+#endif //MQTTSUBSCRIPTION_RETAINED_STORE_H
@@ -6,177 +6,312 @@
 #define MQTTSUBSCRIPTION_RETAINED_TOPIC_MAP_H
 
 #include <mqtt/string_view.hpp>
-#include <map>
-#include "path_tokenizer.h"
 
-template<typename Value >
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <boost/unordered_map.hpp>
+#include "path_tokenizer.h"
+#include "match_frontier.h"
+#include "topic_level_pool.h"
+
+// Retained values indexed by topic. Nodes are stored in a vector and addressed by id, every
+// node keeps the ids of its children in a contiguous list. Exact levels are found through a
+// hash index on (parent id, level id), wildcards iterate the child lists. Subtrees are walked
+// with an explicit stack, so a '#' never recurses and never searches the index. The index
+// nodes and the node storage are allocated with (a rebound copy of) Allocator.
+template<typename Value, typename Allocator = std::allocator<Value> >
 class retained_topic_map
 {
-    typedef size_t node_id_type;
-    typedef std::pair< node_id_type, std::string> path_entry_key;
+    typedef uint32_t node_id_type;
+    typedef topic_level_pool::level_id level_id;
+    typedef std::pair< node_id_type, level_id > path_entry_key;
+
+    template<typename T>
+    using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
 
-    enum { root_node_id = 0 };
+    static constexpr node_id_type root_node_id = 0;
 
     struct path_entry
     {
-        node_id_type id;
-        uint32_t count;
+        node_id_type parent;
 
-        Value value;
+        // The level of this node below its parent, a reference in the topic_level_pool
+        level_id level;
 
-        path_entry(node_id_type _id)
-                : id(_id), count(1)
-        { }
-    };
+        // Position of this node in the child list of the parent
+        uint32_t child_index;
 
-    typedef std::map< path_entry_key, path_entry > map_type;
-    typedef typename map_type::iterator map_type_iterator;
-    typedef typename map_type::const_iterator map_type_const_iterator;
+        // Number of values stored at or below this node
+        uint32_t count;
 
-    map_type map;
-    map_type_iterator root;
-    node_id_type next_node_id;
+        // Incremented when the node is released, to detect stale ids in a cursor
+        uint32_t generation;
 
-    map_type_iterator create_topic(MQTT_NS::string_view const &topic)
-    {
-        boost::tokenizer< boost::char_separator<char> > tokens = mqtt_path_tokenizer(topic);
+        // A first level starting with $, which is not matched by a wildcard at the first level
+        bool system;
 
-        map_type_iterator parent = root;
-        for(boost::tokenizer< boost::char_separator<char> >::const_iterator t = tokens.begin(); t != tokens.end(); ++t) {
-            if(*t == "+" || *t == "#")
-                throw std::runtime_error("No wildcards allowed in retained topic name");
+        boost::optional<Value> value;
+        std::vector< node_id_type, rebind_alloc<node_id_type> > children;
 
-            node_id_type parent_id = parent->second.id;
-            map_type_iterator entry = map.find(path_entry_key(parent_id, *t));
+        path_entry()
+                : parent(root_node_id), level(topic_level_pool::npos), child_index(0), count(0), generation(0), system(false)
+        { }
+    };
 
-            if(entry == map.end())  {
-                entry = map.insert({ path_entry_key(parent_id, *t), path_entry(next_node_id++) }).first;
-            } else {
-                boost::tokenizer< boost::char_separator<char> >::const_iterator next_t = t;
-                ++next_t;
-                entry->second.count++;
-            }
+    typedef boost::unordered_map< path_entry_key, node_id_type, boost::hash<path_entry_key>, std::equal_to<path_entry_key>,
+                                  rebind_alloc< std::pair<const path_entry_key, node_id_type> > > index_type;
 
-            parent = entry;
-        }
+    topic_level_pool &levels;
+    std::vector< path_entry, rebind_alloc<path_entry> > nodes;
+    std::vector<node_id_type> free_nodes;
+    index_type index;
 
-        return parent;
-    }
+    // Marks an entry of the match stack that matches all nodes of a subtree ('#')
+    static constexpr uint32_t subtree_level = std::numeric_limits<uint32_t>::max();
+
+    struct match_item
+    {
+        node_id_type id;
+        uint32_t generation;
+        uint32_t level;
+    };
 
-    std::vector< std::pair<map_type_iterator, map_type_iterator> > find_topic(MQTT_NS::string_view const &topic)
+    node_id_type find_child(node_id_type parent, level_id level) const
     {
-        boost::tokenizer< boost::char_separator<char> > tokens = mqtt_path_tokenizer(topic);
+        if(level == topic_level_pool::npos)
+            return root_node_id;
+        auto i = index.find(path_entry_key(parent, level));
+        return i == index.end() ? root_node_id : i->second;
+    }
 
-        map_type_iterator parent = root;
+    // Create a child node, level is a reference in the topic_level_pool which is owned by the node
+    node_id_type create_child(node_id_type parent, level_id level, bool system)
+    {
+        node_id_type id;
+        if(free_nodes.empty()) {
+            if(nodes.size() == std::numeric_limits<node_id_type>::max())
+                throw std::overflow_error("Too many nodes in retained topic map");
+            id = static_cast<node_id_type>(nodes.size());
+            nodes.emplace_back();
+        } else {
+            id = free_nodes.back();
+            free_nodes.pop_back();
+        }
 
-        std::vector< std::pair<map_type_iterator, map_type_iterator> > path;
+        path_entry &entry = nodes[id];
+        entry.parent = parent;
+        entry.level = level;
+        entry.system = system;
+        entry.child_index = static_cast<uint32_t>(nodes[parent].children.size());
+        nodes[parent].children.push_back(id);
 
-        for (auto const  &t : tokens) {
-            map_type_iterator entry = map.find(path_entry_key(parent->second.id, t));
+        index.emplace(path_entry_key(parent, level), id);
+        return id;
+    }
 
-            if(entry == map.end())
-                return std::vector< std::pair<map_type_iterator, map_type_iterator> >();
+    // Release a node without children
+    void release_node(node_id_type id)
+    {
+        path_entry &entry = nodes[id];
+        auto &siblings = nodes[entry.parent].children;
+
+        // Swap with the last child, so removal from the child list is O(1)
+        node_id_type last = siblings.back();
+        siblings[entry.child_index] = last;
+        nodes[last].child_index = entry.child_index;
+        siblings.pop_back();
+
+        index.erase(path_entry_key(entry.parent, entry.level));
+        levels.release(entry.level);
+
+        entry.level = topic_level_pool::npos;
+        entry.system = false;
+        entry.value = boost::none;
+        entry.children.clear();
+        entry.children.shrink_to_fit();
+        ++entry.generation;
+        free_nodes.push_back(id);
+    }
 
-            path.push_back(std::make_pair(parent, entry));
-            parent = entry;
+    // Return the id of the node at the specified topic, root_node_id when it does not exist
+    node_id_type find_topic(MQTT_NS::string_view const &topic) const
+    {
+        node_id_type id = root_node_id;
+        for (auto const &t : mqtt_path_tokenizer(topic)) {
+            id = find_child(id, levels.find(t));
+            if(id == root_node_id)
+                return root_node_id;
         }
-
-        return path;
+        return id;
     }
 
-    void match_hash_entries(node_id_type parent, std::deque<map_type_const_iterator> &new_entries) const {
-        for(map_type_const_iterator i = map.lower_bound(path_entry_key(parent, "")); i != map.end(); ++i) {
-            if(i->first.first != parent)
-                return;
+    // Return the node at the specified topic, the path is created when it does not exist
+    node_id_type create_topic(MQTT_NS::string_view const &topic)
+    {
+        // Check before creating any node, nodes without a value below them are not allowed
+        for (auto const &t : mqtt_path_tokenizer(topic)) {
+            if(t == "+" || t == "#")
+                throw std::runtime_error("No wildcards allowed in retained topic name");
+        }
 
-            new_entries.push_back(i);
-            match_hash_entries(i->second.id, new_entries);
+        node_id_type id = root_node_id;
+        for (auto const &t : mqtt_path_tokenizer(topic)) {
+            node_id_type child = find_child(id, levels.find(t));
+            if(child == root_node_id) {
+                level_id level = levels.intern(t);
+                try {
+                    child = create_child(id, level, id == root_node_id && !t.empty() && t.front() == '$');
+                } catch(...) {
+                    levels.release(level);
+                    throw;
+                }
+            }
+            id = child;
         }
+        return id;
     }
 
-    // Find all values that math the specified path
-    void find_match(MQTT_NS::string_view const &topic, std::function< void (Value const &) > const &callback) const
+    // Process the match stack until it is empty or max_count values are found. Levels holds the
+    // level ids of the topic filter, levels which are not in the pool are npos
+    template<typename Stack, typename Levels, typename Output>
+    size_t match(Stack &stack, Levels const &levels, size_t max_count, Output &callback) const
     {
-        boost::tokenizer< boost::char_separator<char> > tokens = mqtt_path_tokenizer(topic);
-
-        std::deque<map_type_const_iterator> entries;
-        entries.push_back(root);
+        size_t found = 0;
+        while(!stack.empty() && found < max_count) {
+            match_item item = stack.back();
+            stack.pop_back();
 
-        for (auto const  &t : tokens) {
-            std::deque<map_type_const_iterator> new_entries;
-            new_entries.resize(0);
+            if(item.id >= nodes.size() || nodes[item.id].generation != item.generation)
+                continue;
 
-            bool hash_matched = false;
+            path_entry const &entry = nodes[item.id];
 
-            for(auto const &entry: entries) {
-                node_id_type parent = entry->second.id;
+            if(item.level == subtree_level || item.level == levels.size()) {
+                if(entry.value) {
+                    callback(*entry.value);
+                    ++found;
+                }
 
-                if(t == "+") {
-                    for(map_type_const_iterator i = map.lower_bound(path_entry_key(parent, "")); i != map.end(); ++i) {
-                        if(i->first.first == parent)
-                            new_entries.push_back(i);
-                        else
-                            break;
+                if(item.level == subtree_level) {
+                    for(node_id_type child: entry.children) {
+                        if(!(item.id == root_node_id && nodes[child].system))
+                            stack.push_back(match_item{ child, nodes[child].generation, subtree_level });
                     }
-                } else if(t == "#") {
-                    match_hash_entries(parent, new_entries);
-                    hash_matched = true;
-                } else {
-                    map_type_const_iterator i = map.find(path_entry_key(parent, t));
-                    if(i != map.end())
-                        new_entries.push_back(i);
                 }
+                continue;
             }
 
-            if(new_entries.empty())
-                return;
-            entries = std::move(new_entries);
-
-            if(hash_matched)
-                break;
+            level_id t = levels[item.level];
+            if(t == topic_level_pool::hash_level) {
+                // A multi level wildcard also matches the parent level
+                stack.push_back(match_item{ item.id, item.generation, subtree_level });
+            } else if(t == topic_level_pool::plus_level) {
+                // Wildcards at the first level do not match topics starting with $, like the $SYS topics
+                for(node_id_type child: entry.children) {
+                    if(!(item.id == root_node_id && nodes[child].system))
+                        stack.push_back(match_item{ child, nodes[child].generation, item.level + 1 });
+                }
+            } else {
+                node_id_type child = find_child(item.id, t);
+                if(child != root_node_id)
+                    stack.push_back(match_item{ child, nodes[child].generation, item.level + 1 });
+            }
         }
 
-        for(auto const &entry: entries) {
-            callback(entry->second.value);
-        }
+        return found;
+    }
+
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find_match(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        typename match_frontier<level_id>::lease filter;
+        levels.find_levels(topic, filter->current());
+
+        typename match_frontier<match_item>::lease stack;
+        stack->current().push_back(match_item{ root_node_id, nodes[root_node_id].generation, 0 });
+
+        match(stack->current(), filter->current(), std::numeric_limits<size_t>::max(), callback);
     }
 
     // Remove a value at the specified subscription path
     bool remove_topic(MQTT_NS::string_view const &topic)
     {
-        std::vector< std::pair<map_type_iterator, map_type_iterator> > path = find_topic(topic);
-        if(path.empty())
+        node_id_type id = find_topic(topic);
+        if(id == root_node_id || !nodes[id].value)
             return false;
 
-        for(size_t i = 0; i < path.size(); ++i)
-        {
-            map_type_iterator entry = path[path.size() - i - 1].second;
+        nodes[id].value = boost::none;
 
-            --(entry->second.count);
-            if(entry->second.count == 0)
-                map.erase(entry);
+        // Walk up from the removed value
+        while(id != root_node_id) {
+            node_id_type parent = nodes[id].parent;
+            if(--nodes[id].count == 0)
+                release_node(id);
+            id = parent;
         }
+        --nodes[root_node_id].count;
 
         return true;
     }
 
 public:
+    // State of a find that is processed in steps with find_next. The map may be modified
+    // between steps, values inserted after the cursor was created are not guaranteed to be found
+    class cursor
+    {
+        friend class retained_topic_map;
+
+        // The level ids are resolved again by every step, as the ids of unused levels are reused
+        std::string topic;
+        std::vector<match_item> stack;
+
+    public:
+        // Return true when all matching values are found
+        bool done() const { return stack.empty(); }
+    };
+
     retained_topic_map()
-            : next_node_id(root_node_id)
+            : levels(topic_level_pool::instance())
     {
         // Create the root node
-        root = map.insert({path_entry_key(std::numeric_limits<node_id_type>::max(), ""), path_entry(root_node_id) }).first;
-        ++next_node_id;
+        nodes.emplace_back();
     }
 
+    ~retained_topic_map()
+    {
+        for(auto const &i: nodes) {
+            if(i.level != topic_level_pool::npos)
+                levels.release(i.level);
+        }
+    }
+
+    retained_topic_map(retained_topic_map const &) = delete;
+    retained_topic_map &operator=(retained_topic_map const &) = delete;
+
     // Insert a value at the specified subscription path
     void insert_or_update(MQTT_NS::string_view const &topic, Value const &value)
     {
-        std::vector< std::pair<map_type_iterator, map_type_iterator> > path = find_topic(topic);
-        if(path.empty())
-            this->create_topic(topic)->second.value = value;
-        else
-            path.back().second->second.value = value;
+        node_id_type id = create_topic(topic);
+        if(id == root_node_id)
+            throw std::runtime_error("Empty retained topic name");
+
+        if(!nodes[id].value) {
+            // A new value, count it in all nodes on its path
+            for(node_id_type i = id; i != root_node_id; i = nodes[i].parent)
+                ++nodes[i].count;
+            ++nodes[root_node_id].count;
+        }
+
+        nodes[id].value = value;
     }
 
     // Find all values that math the specified path
@@ -185,11 +320,59 @@ public:
         this->find_match(topic, callback);
     }
 
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        this->find_match(topic, std::forward<Output>(callback));
+    }
+
+    // Start a find that is processed in steps, to stream a large number of values
+    cursor find_cursor(MQTT_NS::string_view const &topic) const
+    {
+        cursor result;
+        result.topic.assign(topic.data(), topic.size());
+        result.stack.push_back(match_item{ root_node_id, nodes[root_node_id].generation, 0 });
+        return result;
+    }
+
+    // Find at most max_count more values of a cursor, returns the number of values found
+    template<typename Output>
+    size_t find_next(cursor &c, size_t max_count, Output &&callback) const
+    {
+        typename match_frontier<level_id>::lease filter;
+        levels.find_levels(c.topic, filter->current());
+        return match(c.stack, filter->current(), max_count, callback);
+    }
+
+    // Call callback(Value const &) for the values of at most max_count nodes, starting at node
+    // position. Returns the position to continue with, all values are visited once the position
+    // reaches end_position(). The map may be modified between calls, values inserted or removed
+    // meanwhile may or may not be visited.
+    template<typename Output>
+    size_t for_each(size_t position, size_t max_count, Output &&callback) const
+    {
+        size_t end = std::min(nodes.size(), position + max_count);
+        for(; position < end; ++position) {
+            if(nodes[position].value)
+                callback(*nodes[position].value);
+        }
+        return position;
+    }
+
+    size_t end_position() const { return nodes.size(); }
+
     // Remove a stored value at the specified topic
     void remove(MQTT_NS::string_view const &topic)
     {
         this->remove_topic(topic);
     }
+
+    // Return the number of nodes in the tree, including the root
+    size_t size() const { return nodes.size() - free_nodes.size(); }
+
+    // Return the number of stored values
+    size_t values() const { return nodes[root_node_id].count; }
 };
 
 #endif //MQTTSUBSCRIPTION_RETAINED_TOPIC_MAP_H
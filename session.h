@@ -0,0 +1,650 @@
+#ifndef MQTTSUBSCRIPTION_SESSION_H
+#define MQTTSUBSCRIPTION_SESSION_H
+
+#include "mqtt_server_cpp.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "subscription_map.h"
+#include "pool_allocator.h"
+#include "concurrent_topic_map.h"
+#include "fanout.h"
+#include "outbound_queue.h"
+#include "timing_wheel.h"
+#include "shared_subscription.h"
+#include "offline_queue.h"
+#include "inflight_window.h"
+#include "logger.h"
+
+using con_t = MQTT_NS::server<>::endpoint_t;
+using con_sp_t = std::shared_ptr<con_t>;
+
+struct session_t;
+
+// A publish sent to any number of sessions. Every recipient shares the topic and contents, the
+// message keeps them alive until the last write completes. The endpoint still builds a publish
+// packet per recipient, which refers to the shared topic and contents instead of copying them.
+struct outgoing_publish
+{
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+};
+
+using outgoing_publish_ptr_t = std::shared_ptr<outgoing_publish const>;
+
+using keep_alive_wheel_t = timing_wheel<session_t>;
+
+// Resolution of the keep-alive, the wheels are advanced every tick
+constexpr std::chrono::milliseconds keep_alive_tick(100);
+
+inline keep_alive_wheel_t::tick_type keep_alive_now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()) / keep_alive_tick;
+}
+
+// The keep-alive timers of the sessions of the calling thread
+inline keep_alive_wheel_t &thread_keep_alive_wheel()
+{
+    static thread_local keep_alive_wheel_t wheel(keep_alive_now());
+    return wheel;
+}
+
+// The retransmit timers of the sessions of the calling thread, advanced with the keep-alive wheel
+inline keep_alive_wheel_t &thread_retransmit_wheel()
+{
+    static thread_local keep_alive_wheel_t wheel(keep_alive_now());
+    return wheel;
+}
+
+using inflight_window_t = inflight_window<outgoing_publish>;
+
+using subscription_value_t = std::pair<std::shared_ptr<session_t>, MQTT_NS::qos>;
+using subscription_map_t = concurrent_topic_map< multiple_subscription_map<subscription_value_t, small_subscriber_vector, subscription_map_base, pool_allocator<subscription_value_t> > >;
+using shared_subscription_map_t = concurrent_topic_map< shared_subscription_map<subscription_value_t> >;
+
+struct session_t
+        : std::enable_shared_from_this<session_t>
+{
+    MQTT_NS::buffer client_id;
+    std::weak_ptr<con_t> con;
+
+    // The io_context running the connection and its index in the pool, set when the client connects
+    boost::asio::io_context *ioc;
+    std::size_t thread_index;
+
+    // Used by the fan-out of every io_context thread to deduplicate subscribers
+    std::vector<fanout_stamp> fanout_stamps;
+
+    // A subscription of the session, the handle removes it from the subscription map
+    struct subscription
+    {
+        MQTT_NS::qos qos;
+        subscription_map_t::map_type::handle handle;
+    };
+
+    using session_subs_t = std::map< MQTT_NS::buffer, subscription >;
+    session_subs_t subscriptions;
+
+    // The shared subscriptions of the session by their $share/<group>/<filter> topic filter
+    struct shared_subscription
+    {
+        MQTT_NS::qos qos;
+        shared_subscription_map_t::map_type::handle handle;
+    };
+
+    using shared_subs_t = std::map< MQTT_NS::buffer, shared_subscription >;
+    shared_subs_t shared_subscriptions;
+
+    // A persistent session keeps its subscriptions when the client disconnects, and queues the
+    // QoS 1 and 2 publishes until the client connects again
+    bool clean_session;
+
+    // Set once the connack is sent, cleared when the connection closes
+    bool connected;
+    bool closed;
+
+    // The publishes queued while the client is disconnected, and while they are sent after the
+    // client connected again
+    offline_queue<outgoing_publish> offline;
+
+    // The session which took over the state of this session when its client connected again,
+    // publishes still arriving for this session are forwarded to it
+    std::weak_ptr<session_t> successor;
+
+    // Publishes handed to the session which are not written yet. Only modified on the connection
+    // thread, read by other threads to deliver shared subscriptions to the least queued member
+    std::atomic<std::size_t> queued_messages;
+
+    // Publishes waiting to be handed to the connection. While the connection is writing, new
+    // publishes wait in the queue, once the writes complete they are handed over in batches
+    // of at most max_batch_bytes.
+    struct queued_publish
+    {
+        outgoing_publish_ptr_t message;
+        MQTT_NS::publish_options options;
+        std::size_t bytes;
+    };
+
+    std::deque<queued_publish> outbound;
+
+    // Publishes at the front of the outbound queue which are known not to be QoS 0, where the
+    // search for the oldest QoS 0 publish to drop continues
+    std::size_t outbound_skip;
+
+    // Publishes handed to the connection of which the write did not complete yet
+    std::size_t writing_messages;
+
+    // Bytes of the publishes in the queue and being written
+    std::size_t queued_bytes;
+
+    bool flush_scheduled;
+    bool disconnecting;
+
+    outbound_limits limits;
+    std::unique_ptr<boost::asio::steady_timer> flush_timer;
+
+    // Handlers waiting until at most the specified number of publishes is queued
+    std::vector< std::pair<std::size_t, std::function<void()> > > writable_handlers;
+
+    // Expires when no packet is received for 1.5 times the keep-alive of the client
+    keep_alive_wheel_t::hook keep_alive_timer;
+    keep_alive_wheel_t::tick_type keep_alive_ticks;
+
+    // The QoS 1 and 2 publishes handed to the connection which are not acknowledged yet. Kept
+    // with the session when the client disconnects, and sent again when it connects again
+    inflight_window_t inflight;
+
+    // Expires when the oldest publish in the window is not acknowledged in time
+    keep_alive_wheel_t::hook retransmit_timer;
+    keep_alive_wheel_t::tick_type retransmit_ticks;
+
+    session_t(const std::weak_ptr<con_t> &con, std::size_t threads, outbound_limits const &limits, offline_limits const &queue_limits)
+        : con(con), ioc(nullptr), thread_index(0), fanout_stamps(threads), clean_session(true), connected(false), closed(false),
+          offline(queue_limits), queued_messages(0), outbound_skip(0), writing_messages(0), queued_bytes(0), flush_scheduled(false), disconnecting(false), limits(limits),
+          keep_alive_timer(this), keep_alive_ticks(0), inflight(limits.receive_maximum), retransmit_timer(this),
+          retransmit_ticks(std::max<keep_alive_wheel_t::tick_type>(1, limits.retransmit_interval / keep_alive_tick))
+    { }
+
+    ~session_t()
+    {
+        BROKER_LOG(debug, "Release session: " << client_id);
+    }
+
+    std::shared_ptr<con_t> get_connection()
+    {
+        auto sp = con.lock();
+        BOOST_ASSERT(sp);
+        return sp;
+    }
+
+    void add_subscription(MQTT_NS::buffer topic, MQTT_NS::qos qos, subscription_map_t::map_type::handle const &handle)
+    {
+        subscriptions[topic] = subscription{ qos, handle };
+    }
+
+    void remove_subscription(MQTT_NS::buffer topic)
+    {
+        auto j = subscriptions.find(topic);
+        if (j != subscriptions.end())
+            subscriptions.erase(j);
+    }
+
+    std::optional<subscription> get_subscription(MQTT_NS::buffer topic) const
+    {
+        auto j = subscriptions.find(topic);
+        if (j != subscriptions.end())
+            return std::make_optional(j->second);
+        else
+            return std::optional<subscription>();
+    }
+
+    // Start enforcing the keep-alive in seconds requested by the client, 0 disables it.
+    // Must be called on the thread of the connection
+    void start_keep_alive(std::uint16_t keep_alive)
+    {
+        keep_alive_ticks = std::chrono::milliseconds(std::uint64_t(keep_alive) * 1500) / keep_alive_tick;
+        touch();
+    }
+
+    // Restart the keep-alive timer, for every packet received. The timer is rounded up by a tick,
+    // as the wheel lags behind the clock by up to a tick
+    void touch()
+    {
+        if(keep_alive_ticks != 0 && !closed) {
+            auto &wheel = thread_keep_alive_wheel();
+            wheel.schedule(keep_alive_timer, wheel.now() + keep_alive_ticks + 1);
+        }
+    }
+
+    void stop_keep_alive()
+    {
+        thread_keep_alive_wheel().cancel(keep_alive_timer);
+    }
+
+    void stop_retransmit()
+    {
+        thread_retransmit_wheel().cancel(retransmit_timer);
+    }
+
+    // Add message to the outbound queue of the session, or to the offline queue while the client
+    // is disconnected. Must be called on the thread of the connection
+    void publish(outgoing_publish_ptr_t const &message, MQTT_NS::publish_options options)
+    {
+        if(auto next = successor.lock()) {
+            boost::asio::dispatch(*next->ioc, [next, message, options] {
+                next->publish(message, options);
+            });
+            return;
+        }
+
+        // The offline publishes are sent first, later publishes queue behind them
+        if(!connected || !offline.empty()) {
+            if(connected || (!clean_session && options.get_qos() != MQTT_NS::qos::at_most_once))
+                queue_offline(message, options.get_qos());
+            return;
+        }
+
+        enqueue(message, options);
+    }
+
+    // Keep the subscriptions of a persistent session after its connection closed, the publishes
+    // not handed to the connection yet are moved to the offline queue
+    void suspend()
+    {
+        for(auto const &p: outbound) {
+            if(p.options.get_qos() != MQTT_NS::qos::at_most_once)
+                queue_offline(p.message, p.options.get_qos());
+            dequeue(p);
+        }
+        clear_outbound();
+    }
+
+    // Drop the publishes not handed to the connection yet, when the session closes
+    void drop_outbound()
+    {
+        for(auto const &p: outbound)
+            dequeue(p);
+        clear_outbound();
+    }
+
+    // Continue with the offline queue of the session this session took over, and accept the
+    // connection. Must be called on the thread of the connection
+    void resume(offline_queue<outgoing_publish> &&queue, inflight_window_t &&window)
+    {
+        // Nothing is handed to the connection before the session is resumed, the window is empty
+        inflight = std::move(window);
+
+        // Publishes forwarded to this session before the takeover completed are sent last
+        auto forwarded = std::move(offline);
+        offline = std::move(queue);
+        forwarded.pop(forwarded.size(), [this](auto &&e) {
+            queue_offline(e.first, e.second);
+        });
+
+        // The connection closed meanwhile, this session is offline now
+        auto sp = con.lock();
+        if(closed || !sp)
+            return;
+
+        connected = true;
+        sp->connack(true, MQTT_NS::connect_return_code::accepted);
+
+        // The publishes not acknowledged on the previous connection are sent again first, with
+        // their packet ids
+        auto now = thread_retransmit_wheel().now();
+        inflight.for_each([this, &sp, now](inflight_window_t::entry &e) {
+            sp->register_packet_id(e.packet_id);
+            e.sent = now;
+            resend(*sp, e);
+        });
+        schedule_retransmit();
+
+        replay_offline();
+    }
+
+    // Accept the connection of a new session
+    void accept()
+    {
+        connected = true;
+        get_connection()->connack(false, MQTT_NS::connect_return_code::accepted);
+    }
+
+    // A puback or pubcomp is received, the next publish waiting for the window is sent
+    void acknowledge(inflight_window_t::packet_id_type packet_id)
+    {
+        if(!inflight.acknowledge(packet_id)) {
+            BROKER_LOG(debug, "Unknown packet id acknowledged: " << packet_id << ", client id: " << client_id);
+            return;
+        }
+
+        if(inflight.empty())
+            thread_retransmit_wheel().cancel(retransmit_timer);
+        if(writing_messages == 0)
+            flush();
+    }
+
+    // A pubrec is received, the pubrel is sent by the connection
+    void received(inflight_window_t::packet_id_type packet_id)
+    {
+        if(!inflight.received(packet_id, thread_retransmit_wheel().now()))
+            BROKER_LOG(debug, "Unknown packet id received: " << packet_id << ", client id: " << client_id);
+    }
+
+    // Send the publishes and pubrels which are not acknowledged in time again, in one batch.
+    // Called by the retransmit wheel of the thread
+    void retransmit()
+    {
+        auto sp = con.lock();
+        if(!connected || !sp)
+            return;
+
+        auto &wheel = thread_retransmit_wheel();
+        thread_outbound_statistics().retransmits += inflight.expire(wheel.now(), retransmit_ticks, [this, &sp](inflight_window_t::entry &e) {
+            resend(*sp, e);
+        });
+        schedule_retransmit();
+    }
+
+    // Add message to the outbound queue of the session. When the queue is full the slow consumer
+    // policy decides which publish is dropped
+    void enqueue(outgoing_publish_ptr_t const &message, MQTT_NS::publish_options options)
+    {
+        if(disconnecting)
+            return;
+
+        std::size_t bytes = message->topic.size() + message->contents.size();
+        if(queued() + 1 > limits.max_queued_messages || queued_bytes + bytes > limits.max_queued_bytes) {
+            if(!make_room(bytes))
+                return;
+        }
+
+        set_queued(queued() + 1);
+        queued_bytes += bytes;
+        thread_outbound_statistics().queued(bytes);
+        outbound.push_back(queued_publish{ message, options, bytes });
+
+        if(writing_messages != 0)
+            return;
+
+        if(queued_bytes >= limits.max_batch_bytes)
+            flush();
+        else if(!flush_scheduled)
+            schedule_flush();
+    }
+
+    // Can be called from any thread, the publish is executed on the thread of the connection
+    void publish(MQTT_NS::buffer topic_name, MQTT_NS::buffer contents, MQTT_NS::publish_options options)
+    {
+        auto message = std::make_shared<outgoing_publish const>(outgoing_publish{ topic_name, contents });
+        boost::asio::dispatch(*ioc, [self = shared_from_this(), message, options] {
+            self->publish(message, options);
+        });
+    }
+
+    // Post handler to the connection thread once at most max_queued publishes are waiting to be written.
+    // Must be called on the connection thread
+    void when_writable(std::size_t max_queued, std::function<void()> handler)
+    {
+        if(queued() <= max_queued)
+            boost::asio::post(*ioc, std::move(handler));
+        else
+            writable_handlers.emplace_back(max_queued, std::move(handler));
+    }
+
+private:
+    // Offline publishes sent per batch, the next batch waits until the outbound queue is this short
+    enum : std::size_t { offline_batch = 64 };
+
+    void queue_offline(outgoing_publish_ptr_t const &message, MQTT_NS::qos qos)
+    {
+        try {
+            if(!offline.push(message, qos))
+                ++thread_outbound_statistics().dropped_offline;
+        } catch(std::exception &e) {
+            BROKER_LOG(error, "Failed to queue offline publish for " << client_id << ": " << e.what());
+            ++thread_outbound_statistics().dropped_offline;
+        }
+    }
+
+    // Send the offline publishes in batches, after every batch wait for the outbound queue
+    void replay_offline()
+    {
+        // Posted before the session closed
+        if(!connected)
+            return;
+
+        try {
+            offline.pop(offline_batch, [this](auto &&e) {
+                enqueue(e.first, e.second | MQTT_NS::retain::no);
+            });
+        } catch(std::exception &e) {
+            BROKER_LOG(error, "Failed to read offline publishes of " << client_id << ": " << e.what());
+            offline.clear();
+        }
+
+        if(!offline.empty() && connected) {
+            when_writable(offline_batch, [self = shared_from_this()] {
+                self->replay_offline();
+            });
+        }
+    }
+
+    void schedule_retransmit()
+    {
+        if(!inflight.empty())
+            thread_retransmit_wheel().schedule(retransmit_timer, inflight.next_expiry(retransmit_ticks));
+    }
+
+    // Send a publish of the window again with the dup flag, or its pubrel once the pubrec was received
+    void resend(con_t &connection, inflight_window_t::entry const &e)
+    {
+        if(e.state == inflight_window_t::phase::release) {
+            connection.async_pubrel(e.packet_id);
+            return;
+        }
+
+        connection.async_publish(
+                e.packet_id,
+                boost::asio::buffer(e.message->topic),
+                boost::asio::buffer(e.message->contents),
+                e.message, e.qos | MQTT_NS::retain::no | MQTT_NS::dup::yes,
+                [](MQTT_NS::error_code) { });
+    }
+
+    void schedule_flush()
+    {
+        flush_scheduled = true;
+
+        // A posted handler runs after the handlers which are ready, so the publishes of this
+        // event loop iteration end up in the same batch
+        if(limits.max_batch_delay.count() == 0) {
+            boost::asio::post(*ioc, [self = shared_from_this()] {
+                self->flush_scheduled = false;
+                self->flush();
+            });
+            return;
+        }
+
+        if(!flush_timer)
+            flush_timer = std::make_unique<boost::asio::steady_timer>(*ioc);
+        flush_timer->expires_after(limits.max_batch_delay);
+        flush_timer->async_wait([self = shared_from_this()](MQTT_NS::error_code) {
+            self->flush_scheduled = false;
+            self->flush();
+        });
+    }
+
+    // Apply the slow consumer policy to make room for a publish of bytes, return whether the
+    // publish should be queued
+    bool make_room(std::size_t bytes)
+    {
+        auto &stats = thread_outbound_statistics();
+
+        switch(limits.policy) {
+            case slow_consumer_policy::drop_oldest_qos0:
+                while(queued() + 1 > limits.max_queued_messages || queued_bytes + bytes > limits.max_queued_bytes) {
+                    auto i = std::find_if(outbound.begin() + outbound_skip, outbound.end(), [](queued_publish const &p) {
+                        return p.options.get_qos() == MQTT_NS::qos::at_most_once;
+                    });
+                    outbound_skip = i - outbound.begin();
+                    if(i == outbound.end())
+                        break;
+
+                    dequeue(*i);
+                    outbound.erase(i);
+                    ++stats.dropped_oldest;
+                }
+
+                if(queued() + 1 <= limits.max_queued_messages && queued_bytes + bytes <= limits.max_queued_bytes)
+                    return true;
+
+                ++stats.dropped_newest;
+                return false;
+
+            case slow_consumer_policy::drop_newest:
+                ++stats.dropped_newest;
+                return false;
+
+            case slow_consumer_policy::disconnect:
+                BROKER_LOG(warning, "Disconnect slow consumer: " << client_id << ", queued " << queued()
+                        << " publishes, " << queued_bytes << " bytes");
+                ++stats.disconnects;
+                disconnecting = true;
+
+                drop_outbound();
+
+                if(auto sp = con.lock())
+                    sp->async_force_disconnect();
+                return false;
+        }
+        return false;
+    }
+
+    std::size_t queued() const { return queued_messages.load(std::memory_order_relaxed); }
+
+    // Only the connection thread writes the count, so it needs no read-modify-write
+    void set_queued(std::size_t count) { queued_messages.store(count, std::memory_order_relaxed); }
+
+    // The handlers waiting for the queue hold the session, they are dropped with the queue so a
+    // closed session is freed
+    void clear_outbound()
+    {
+        outbound.clear();
+        outbound_skip = 0;
+        writable_handlers.clear();
+    }
+
+    // Remove a publish which is not handed to the connection from the counters
+    void dequeue(queued_publish const &p)
+    {
+        set_queued(queued() - 1);
+        queued_bytes -= p.bytes;
+        thread_outbound_statistics().dequeued(p.bytes);
+    }
+
+    // Hand a batch of at most max_batch_bytes to the connection, when no write is in progress.
+    // With bulk write enabled on the endpoint, the batch is written with a single gathered write.
+    void flush()
+    {
+        // Nothing more is handed to a closing connection, nor added to its window
+        if(closed || !connected || outbound.empty() || writing_messages != 0)
+            return;
+
+        auto sp = con.lock();
+        if(!sp) {
+            drop_outbound();
+            return;
+        }
+
+        std::size_t batch_messages = 0;
+        std::size_t batch_bytes = 0;
+        while(!outbound.empty() && (batch_messages == 0 || batch_bytes + outbound.front().bytes <= limits.max_batch_bytes)) {
+            // A QoS 1 or 2 publish waits for an acknowledgement when the window is full, the
+            // publishes behind it wait as well to keep the order
+            bool acknowledged = outbound.front().options.get_qos() != MQTT_NS::qos::at_most_once;
+            if(acknowledged && inflight.full()) {
+                ++thread_outbound_statistics().window_full;
+                break;
+            }
+
+            queued_publish p = std::move(outbound.front());
+            outbound.pop_front();
+            if(outbound_skip != 0)
+                --outbound_skip;
+
+            ++batch_messages;
+            batch_bytes += p.bytes;
+            ++writing_messages;
+
+            auto written = [self = shared_from_this(), bytes = p.bytes](MQTT_NS::error_code) {
+                self->on_publish_written(bytes);
+            };
+
+            if(!acknowledged) {
+                sp->async_publish(boost::asio::buffer(p.message->topic), boost::asio::buffer(p.message->contents),
+                                  p.message, p.options, std::move(written));
+                continue;
+            }
+
+            // The packet ids of the connection are assigned by the window
+            auto packet_id = inflight.add(p.message, p.options.get_qos(), thread_retransmit_wheel().now());
+            sp->register_packet_id(packet_id);
+            if(!retransmit_timer.linked())
+                schedule_retransmit();
+
+            sp->async_publish(packet_id, boost::asio::buffer(p.message->topic), boost::asio::buffer(p.message->contents),
+                              p.message, p.options, std::move(written));
+        }
+
+        if(batch_messages != 0)
+            thread_outbound_statistics().add_batch(batch_messages, batch_bytes);
+    }
+
+    void on_publish_written(std::size_t bytes)
+    {
+        --writing_messages;
+        set_queued(queued() - 1);
+        queued_bytes -= bytes;
+        thread_outbound_statistics().dequeued(bytes);
+
+        // The publishes queued during the writes form the next batch
+        if(writing_messages == 0)
+            flush();
+
+        for(size_t i = 0; i < writable_handlers.size(); ) {
+            if(queued() <= writable_handlers[i].first) {
+                boost::asio::post(*ioc, std::move(writable_handlers[i].second));
+                writable_handlers[i] = std::move(writable_handlers.back());
+                writable_handlers.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+};
+
+using session_ptr_t = std::shared_ptr<session_t>;
+using session_weak_ptr_t = std::weak_ptr<session_t>;
+
+// Publish message to a batch of sessions which all run on the same thread, with one handler
+// for the whole batch. The qos of every recipient is the qos it receives the message with.
+inline void deliver(fanout_batches<session_t>::lease &&recipients, outgoing_publish_ptr_t const &message)
+{
+    boost::asio::io_context &ioc = *recipients->front().first->ioc;
+    boost::asio::dispatch(ioc, [recipients = std::move(recipients), message] {
+        for(auto const &r: *recipients)
+            r.first->publish(message, r.second | MQTT_NS::retain::no);
+    });
+}
+
+#endif //MQTTSUBSCRIPTION_SESSION_H
@@ -0,0 +1,264 @@
+#ifndef MQTTSUBSCRIPTION_SHARED_SUBSCRIPTION_H
+#define MQTTSUBSCRIPTION_SHARED_SUBSCRIPTION_H
+
+#include <mqtt/string_view.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include "subscription_map.h"
+
+// How a publish matching a shared subscription selects the member of the group receiving it
+enum class shared_delivery
+{
+    round_robin,
+
+    // The member with the fewest queued publishes
+    least_queued
+};
+
+static inline char const *shared_delivery_name(shared_delivery delivery)
+{
+    switch(delivery) {
+        case shared_delivery::round_robin: return "round-robin";
+        case shared_delivery::least_queued: return "least-queued";
+    }
+    return "unknown";
+}
+
+static inline shared_delivery shared_delivery_from_name(MQTT_NS::string_view const &name)
+{
+    for(int i = int(shared_delivery::round_robin); i <= int(shared_delivery::least_queued); ++i)
+        if(name == shared_delivery_name(shared_delivery(i)))
+            return shared_delivery(i);
+    throw std::runtime_error(std::string("Unknown shared delivery: ").append(name.data(), name.size()));
+}
+
+// A shared subscription $share/<group>/<filter>, both refer to the subscribed topic filter
+struct shared_filter
+{
+    MQTT_NS::string_view group;
+    MQTT_NS::string_view filter;
+
+    // The group and filter as stored by the map, <group>/<filter>
+    MQTT_NS::string_view key;
+};
+
+// Return the group and filter of a shared subscription, nothing for other topic filters.
+// Throws when the topic filter starts with $share/ but is not a valid shared subscription.
+inline std::optional<shared_filter> parse_shared_filter(MQTT_NS::string_view const &topic_filter)
+{
+    MQTT_NS::string_view const prefix("$share/");
+    if(topic_filter.substr(0, prefix.size()) != prefix)
+        return std::nullopt;
+
+    MQTT_NS::string_view key = topic_filter.substr(prefix.size());
+    auto separator = key.find(mqtt_path_separator);
+    if(separator == 0 || separator == MQTT_NS::string_view::npos || separator + 1 == key.size())
+        throw std::runtime_error("Shared subscription without group or topic filter");
+
+    MQTT_NS::string_view group = key.substr(0, separator);
+    if(group.find_first_of("+#") != MQTT_NS::string_view::npos)
+        throw std::runtime_error("Shared subscription group contains a wildcard");
+
+    return shared_filter{ group, key.substr(separator + 1), key };
+}
+
+// The members of a shared subscription group. Members are stored densely so a member can be
+// selected in O(1), the position of a member is looked up by its id to remove it in O(1).
+// Modified under exclusive access, members can be selected by any number of threads.
+template<typename Value>
+class share_group
+{
+    // <group>/<filter>
+    std::string stored_key;
+
+    std::vector< std::pair<uint32_t, Value> > members;
+    std::vector<uint32_t> positions;
+    std::vector<uint32_t> free_ids;
+
+    mutable std::atomic<std::size_t> next{ 0 };
+
+public:
+    explicit share_group(MQTT_NS::string_view const &_key)
+            : stored_key(_key.data(), _key.size())
+    { }
+
+    share_group(share_group const &) = delete;
+    share_group &operator=(share_group const &) = delete;
+
+    // Add a member, returns the id to remove it with
+    uint32_t add(Value const &value)
+    {
+        uint32_t id;
+        if(free_ids.empty()) {
+            id = static_cast<uint32_t>(positions.size());
+            positions.push_back(0);
+        } else {
+            id = free_ids.back();
+            free_ids.pop_back();
+        }
+
+        positions[id] = static_cast<uint32_t>(members.size());
+        members.emplace_back(id, value);
+        return id;
+    }
+
+    void replace(uint32_t id, Value const &value)
+    {
+        members[positions[id]].second = value;
+    }
+
+    // Remove a member, the last member takes its position
+    void remove(uint32_t id)
+    {
+        uint32_t position = positions[id];
+        if(position + 1 != members.size()) {
+            members[position] = std::move(members.back());
+            positions[members[position].first] = position;
+        }
+
+        members.pop_back();
+        free_ids.push_back(id);
+    }
+
+    // Return the member receiving the next publish, queued(Value const &) returns the number of
+    // publishes queued for a member. The group should not be empty
+    template<typename Queued>
+    Value const &select(shared_delivery delivery, Queued &&queued) const
+    {
+        if(delivery == shared_delivery::round_robin || members.size() == 1)
+            return members[next.fetch_add(1, std::memory_order_relaxed) % members.size()].second;
+
+        // Start at the next member, so members with equal queues take turns
+        std::size_t start = next.fetch_add(1, std::memory_order_relaxed) % members.size();
+        std::size_t best = start;
+        std::size_t best_queued = queued(members[start].second);
+
+        for(std::size_t i = 1; i < members.size() && best_queued != 0; ++i) {
+            std::size_t j = (start + i) % members.size();
+            std::size_t n = queued(members[j].second);
+            if(n < best_queued) {
+                best = j;
+                best_queued = n;
+            }
+        }
+        return members[best].second;
+    }
+
+    MQTT_NS::string_view key() const { return stored_key; }
+    MQTT_NS::string_view name() const { return key().substr(0, stored_key.find(mqtt_path_separator)); }
+    MQTT_NS::string_view filter() const { return key().substr(stored_key.find(mqtt_path_separator) + 1); }
+
+    std::size_t size() const { return members.size(); }
+    bool empty() const { return members.empty(); }
+};
+
+// The shared subscriptions of the broker. A group is created by its first member and removed
+// with its last member, the groups are found by their topic filter in a subscription map.
+template<typename Value>
+class shared_subscription_map
+{
+public:
+    typedef share_group<Value> group_type;
+
+    // Identifies a member inserted in the map, valid until the member is removed
+    class handle
+    {
+        friend class shared_subscription_map;
+
+        group_type *group;
+        uint32_t member;
+
+        handle(group_type *_group, uint32_t _member)
+                : group(_group), member(_member)
+        { }
+
+    public:
+        handle()
+                : group(nullptr), member(std::numeric_limits<uint32_t>::max())
+        { }
+    };
+
+private:
+    typedef multiple_subscription_map<group_type *> filter_map_type;
+
+    struct entry
+    {
+        std::unique_ptr<group_type> group;
+        typename filter_map_type::handle filter_handle;
+    };
+
+    struct key_hash
+    {
+        std::size_t operator()(MQTT_NS::string_view const &key) const { return boost::hash_range(key.begin(), key.end()); }
+    };
+
+    filter_map_type filters;
+
+    // The groups by <group>/<filter>, the keys refer to the key stored by the group
+    boost::unordered_map< MQTT_NS::string_view, entry, key_hash > groups;
+
+public:
+    shared_subscription_map() = default;
+
+    shared_subscription_map(shared_subscription_map const &) = delete;
+    shared_subscription_map &operator=(shared_subscription_map const &) = delete;
+
+    // Add a member to the group of a shared subscription, the group is created when it does not exist
+    handle insert(shared_filter const &filter, Value const &value)
+    {
+        auto i = groups.find(filter.key);
+        if(i == groups.end()) {
+            auto group = std::make_unique<group_type>(filter.key);
+            auto filter_handle = filters.insert(group->filter(), group.get());
+            MQTT_NS::string_view key = group->key();
+            i = groups.emplace(key, entry{ std::move(group), filter_handle }).first;
+        }
+
+        return handle(i->second.group.get(), i->second.group->add(value));
+    }
+
+    // Remove a member with the handle returned by insert, the group is removed with its last member
+    void remove(handle const &h)
+    {
+        group_type &group = *h.group;
+        group.remove(h.member);
+        if(!group.empty())
+            return;
+
+        auto i = groups.find(group.key());
+        BOOST_ASSERT(i != groups.end());
+        filters.remove(group.filter(), i->second.filter_handle);
+        groups.erase(i);
+    }
+
+    // Replace the value of a member with the handle returned by insert
+    void replace(handle const &h, Value const &value)
+    {
+        h.group->replace(h.member, value);
+    }
+
+    // Call callback(group_type const &) for every group with a topic filter matching topic
+    template<typename Output>
+    void find(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        filters.find(topic, [&callback](group_type *group) {
+            callback(static_cast<group_type const &>(*group));
+        });
+    }
+
+    // Return the number of groups
+    std::size_t size() const { return groups.size(); }
+};
+
+#endif //MQTTSUBSCRIPTION_SHARED_SUBSCRIPTION_H
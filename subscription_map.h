@@ -7,14 +7,29 @@
 
 #include <mqtt/string_view.hpp>
 
-#include <unordered_map>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/container/small_vector.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/optional.hpp>
+#include <boost/unordered_map.hpp>
 #include "path_tokenizer.h"
+#include "match_frontier.h"
+#include "topic_level_pool.h"
 
-template<typename Value>
+// Subscription map backend where all nodes are stored in one hash map, keyed by the id of
+// the parent node and the id of the level in the topic_level_pool. The nodes are allocated
+// with (a rebound copy of) Allocator, for example pool_allocator from pool_allocator.h.
+template<typename Value, typename Allocator = std::allocator<Value> >
 class subscription_map_base
 {
-    typedef size_t node_id;
-    typedef std::pair< node_id, std::string> path_entry_key;
+    typedef uint32_t node_id;
+    typedef topic_level_pool::level_id level_id;
+    typedef std::pair< node_id, level_id > path_entry_key;
 
     enum { root_node_id = 0 };
 
@@ -33,29 +48,61 @@ class subscription_map_base
         { }
     };
 
-    typedef std::unordered_map< path_entry_key, path_entry, boost::hash< path_entry_key > > map_type;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc< std::pair<const path_entry_key, path_entry> > map_allocator;
+    typedef boost::unordered_map< path_entry_key, path_entry, boost::hash<path_entry_key>, std::equal_to<path_entry_key>, map_allocator > map_type;
     typedef typename map_type::iterator map_type_iterator;
     typedef typename map_type::const_iterator map_type_const_iterator;
 
+    topic_level_pool &levels;
     map_type map;
     map_type_iterator root;
     node_id next_node_id;
 
+    // Ids of erased nodes, reused so the 32-bit ids do not run out when subscriptions churn
+    std::vector<node_id> free_node_ids;
+
+    node_id create_node_id()
+    {
+        if(!free_node_ids.empty()) {
+            node_id result = free_node_ids.back();
+            free_node_ids.pop_back();
+            return result;
+        }
+
+        if(next_node_id == std::numeric_limits<node_id>::max())
+            throw std::overflow_error("Too many nodes in subscription map");
+        return next_node_id++;
+    }
+
 protected:
-    map_type_iterator end() { return map.end(); }
+    map_type_iterator find_entry(node_id parent, level_id level)
+    {
+        return map.find(path_entry_key(parent, level));
+    }
 
-    std::vector< std::pair<map_type_iterator, map_type_iterator> > find_subscription(MQTT_NS::string_view const &topic)
+    map_type_const_iterator find_entry(node_id parent, level_id level) const
+    {
+        return map.find(path_entry_key(parent, level));
+    }
+
+    // The (parent, entry) pairs on the path of a subscription, inline for common topic depths
+    typedef boost::container::small_vector< std::pair<map_type_iterator, map_type_iterator>, 8 > path_type;
+
+    path_type find_subscription(MQTT_NS::string_view const &topic)
     {
         auto tokens = mqtt_path_tokenizer(topic);
         auto parent = root;
 
-        std::vector< std::pair<map_type_iterator, map_type_iterator> > path;
+        path_type path;
 
         for (auto const  &t : tokens) {
-            auto entry = map.find(path_entry_key(parent->second.id, t));
+            level_id level = levels.find(t);
+            auto entry = (level == topic_level_pool::npos ? map.end() : find_entry(parent->second.id, level));
 
-            if(entry == map.end())
-                return std::vector< std::pair<map_type_iterator, map_type_iterator> >();
+            if(entry == map.end()) {
+                path.clear();
+                break;
+            }
 
             path.push_back(std::make_pair(parent, entry));
             parent = entry;
@@ -64,40 +111,50 @@ protected:
         return path;
     }
 
-    map_type_iterator create_subscription(MQTT_NS::string_view const &topic)
+    // Create the path for a subscription and return its (leaf) entry
+    path_entry *create_subscription(MQTT_NS::string_view const &topic)
     {
         auto tokens = mqtt_path_tokenizer(topic);
 
         auto parent = root;
-        for(auto t = tokens.begin(); t != tokens.end(); ++t) {
+        for (auto const  &t : tokens) {
             auto parent_id = parent->second.id;
-            auto entry = map.find(path_entry_key(parent_id, *t));
+            level_id level = levels.find(t);
+            auto entry = (level == topic_level_pool::npos ? map.end() : find_entry(parent_id, level));
 
             if(entry == map.end())  {
-                entry = map.insert({ path_entry_key(parent_id, *t), path_entry(next_node_id++) }).first;
-                if(*t == "+")
+                // Every node holds a reference to its level
+                level = levels.intern(t);
+                try {
+                    entry = map.insert({ path_entry_key(parent_id, level), path_entry(create_node_id()) }).first;
+                } catch(...) {
+                    levels.release(level);
+                    throw;
+                }
+
+                if(level == topic_level_pool::plus_level)
                     parent->second.has_plus_child = true;
-                if(*t == "#")
+                if(level == topic_level_pool::hash_level)
                     parent->second.has_hash_child = true;
 
             } else {
-                auto next_t = t;
-                ++next_t;
                 entry->second.count++;
             }
 
             parent = entry;
         }
 
-        return parent;
+        return &parent->second;
     }
 
-    // Remove a value at the specified subscription path
-    map_type_iterator remove_subscription(MQTT_NS::string_view const &topic)
+    // Remove a value at the specified subscription path, returns the entry when it still exists afterwards
+    path_entry *remove_subscription(MQTT_NS::string_view const &topic)
     {
         auto path = find_subscription(topic);
         if(path.empty())
-            return map.end();
+            return nullptr;
+
+        path_entry *result = &path.back().second->second;
 
         for(size_t i = 0; i < path.size(); ++i)
         {
@@ -106,49 +163,60 @@ protected:
 
             --(entry->second.count);
             if(entry->second.count == 0) {
-                if(entry->first.second == "+")
+                level_id level = entry->first.second;
+                if(level == topic_level_pool::plus_level)
                     parent->second.has_plus_child = false;
-                if(entry->first.second == "#")
+                if(level == topic_level_pool::hash_level)
                     parent->second.has_hash_child = false;
 
+                // The children of entry are already erased, so no key refers to its id anymore
+                free_node_ids.push_back(entry->second.id);
                 map.erase(entry);
+                levels.release(level);
                 if(i == 0)
-                    return map.end();
+                    result = nullptr;
             }
         }
 
-        return path.back().second;
+        return result;
     }
 
-    // Find all values that math the specified path
-    void find_match(MQTT_NS::string_view const &topic, std::function< void (Value const &) > const &callback) const
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find_match(MQTT_NS::string_view const &topic, Output &&callback) const
     {
-        auto tokens = mqtt_path_tokenizer(topic);
-
-        std::deque<map_type_const_iterator> entries;
-        entries.push_back(root);
+        // Levels which are not in the pool are not used by any node, they only match wildcards
+        typename match_frontier<level_id>::lease topic_levels;
+        levels.find_levels(topic, topic_levels->current());
 
-        std::deque<map_type_const_iterator> new_entries;
+        typename match_frontier<map_type_const_iterator>::lease entries;
+        entries->current().push_back(root);
 
-        for (auto const  &t : tokens) {
-            new_entries.resize(0);
+        // Wildcards at the first level do not match topics starting with $, like the $SYS topics
+        bool system_topic = !topic.empty() && topic.front() == '$';
 
-            for(auto const &entry: entries) {
+        for (level_id t : topic_levels->current()) {
+            for(auto const &entry: entries->current()) {
                 auto parent = entry->second.id;
-                auto i = map.find(path_entry_key(parent, t));
-                if(i != map.end())
-                    new_entries.push_back(i);
+                if(t != topic_level_pool::npos) {
+                    auto i = find_entry(parent, t);
+                    if(i != map.end())
+                        entries->next().push_back(i);
+                }
+
+                if(system_topic && entry == root)
+                    continue;
 
                 if(entry->second.has_plus_child)
                 {
-                    i = map.find(path_entry_key(parent, "+"));
+                    auto i = find_entry(parent, topic_level_pool::plus_level);
                     if(i != map.end())
-                        new_entries.push_back(i);
+                        entries->next().push_back(i);
                 }
 
                 if(entry->second.has_hash_child)
                 {
-                    i = map.find(path_entry_key(parent, "#"));
+                    auto i = find_entry(parent, topic_level_pool::hash_level);
                     if(i != map.end())
                     {
                         callback(i->second.value);
@@ -156,31 +224,44 @@ protected:
                 }
             }
 
-            if(new_entries.empty())
+            if(entries->next().empty())
                 return;
-            entries = new_entries;
+            entries->advance();
         }
 
-        for(auto const &entry: entries)
+        for(auto const &entry: entries->current())
             callback(entry->second.value);
     }
 
     subscription_map_base()
-            : next_node_id(root_node_id)
+            : levels(topic_level_pool::instance()), next_node_id(root_node_id)
     {
         // Create the root node
-        root = map.insert({path_entry_key(std::numeric_limits<node_id>::max(), ""), path_entry(root_node_id) }).first;
+        root = map.insert({path_entry_key(std::numeric_limits<node_id>::max(), topic_level_pool::npos), path_entry(root_node_id) }).first;
         ++next_node_id;
     }
 
+    ~subscription_map_base()
+    {
+        for(auto const &i: map) {
+            if(i.first.second != topic_level_pool::npos)
+                levels.release(i.first.second);
+        }
+    }
+
+    subscription_map_base(subscription_map_base const &) = delete;
+    subscription_map_base &operator=(subscription_map_base const &) = delete;
+
 public:
     // Return the number of elements in the tree
     size_t size() const { return map.size(); }
 };
 
-template<typename Value>
+// The storage backend is selected with the Base template parameter, for example
+// subscription_trie_base from subscription_trie.h. All backends offer the same interface.
+template<typename Value, template <typename, typename> class Base = subscription_map_base, typename Allocator = std::allocator<Value> >
 class single_subscription_map
-        : public subscription_map_base<Value>
+        : public Base<Value, Allocator>
 {
 
 public:
@@ -190,7 +271,7 @@ public:
     {
         if(!this->find_subscription(topic).empty())
             throw std::runtime_error(std::string("Subscription already exists in map: ").append(topic.data(), topic.size()));
-        this->create_subscription(topic)->second.value = value;
+        this->create_subscription(topic)->value = value;
     }
 
     // Remove a value at the specified subscription path
@@ -204,36 +285,245 @@ public:
     {
         this->find_match(topic, callback);
     }
+
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        this->find_match(topic, std::forward<Output>(callback));
+    }
+};
+
+
+// The values of a node in a multiple_subscription_map. A removed value leaves a free slot that
+// is reused by the next insert, so the slot of a value does not change while it is stored and
+// the value can be removed by its slot in O(1). The free slots form a list through the slots.
+template<typename Value, template <typename, typename> class Cont, typename Allocator = std::allocator<Value> >
+class subscription_slots
+{
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+private:
+    struct slot
+    {
+        boost::optional<Value> value;
+        uint32_t next_free;
+    };
+
+    typedef Cont<slot, typename std::allocator_traits<Allocator>::template rebind_alloc<slot> > container_type;
+
+    container_type slots;
+    uint32_t first_free;
+    uint32_t used;
+
+public:
+    subscription_slots()
+            : first_free(npos), used(0)
+    { }
+
+    // Store a value and return its slot
+    uint32_t insert(Value const &value)
+    {
+        uint32_t index = first_free;
+        if(index == npos) {
+            if(slots.size() >= npos)
+                throw std::overflow_error("Too many values in subscription");
+            index = static_cast<uint32_t>(slots.size());
+            slots.push_back(slot{ value, npos });
+        } else {
+            first_free = slots[index].next_free;
+            slots[index].value = value;
+        }
+
+        ++used;
+        return index;
+    }
+
+    void erase(uint32_t index)
+    {
+        BOOST_ASSERT(index < slots.size() && slots[index].value);
+        slots[index].value = boost::none;
+        slots[index].next_free = first_free;
+        first_free = index;
+
+        // Release the free slots and their storage once the last value is removed
+        if(--used == 0) {
+            container_type().swap(slots);
+            first_free = npos;
+        }
+    }
+
+    void replace(uint32_t index, Value const &value)
+    {
+        BOOST_ASSERT(index < slots.size() && slots[index].value);
+        slots[index].value = value;
+    }
+
+    // Return the slot of a value, npos when the value is not stored
+    uint32_t find(Value const &value) const
+    {
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(slots[i].value && *slots[i].value == value)
+                return static_cast<uint32_t>(i);
+        }
+        return npos;
+    }
+
+    // Call f(Value const &) for all stored values
+    template<typename F>
+    void for_each(F &&f) const
+    {
+        for(auto const &i: slots) {
+            if(i.value)
+                f(*i.value);
+        }
+    }
+
+    size_t size() const { return used; }
+};
+
+// Modification counters of the subscriptions of a map, by the first level of the topic filter.
+// The matches of a publish topic can only change when the counter of its first level, or the
+// counter of the wildcard filters changes. Levels share counters by hash, so a modification
+// can also invalidate unrelated topics, but never misses a related one.
+class topic_generations
+{
+    enum { buckets = 256 };
+
+    uint64_t levels[buckets] = {};
+    uint64_t wildcards = 0;
+
+    static std::size_t bucket(MQTT_NS::string_view const &level)
+    {
+        return boost::hash_range(level.begin(), level.end()) % buckets;
+    }
+
+    static MQTT_NS::string_view first_level(MQTT_NS::string_view const &topic)
+    {
+        return topic.substr(0, topic.find(mqtt_path_separator));
+    }
+
+public:
+    struct stamp
+    {
+        uint64_t level;
+        uint64_t wildcards;
+
+        bool operator==(stamp const &other) const { return level == other.level && wildcards == other.wildcards; }
+        bool operator!=(stamp const &other) const { return !(*this == other); }
+    };
+
+    // Called for every subscription inserted in or removed from the map
+    void modified(MQTT_NS::string_view const &topic_filter)
+    {
+        MQTT_NS::string_view level = first_level(topic_filter);
+        if(level == "+" || level == "#")
+            ++wildcards;
+        else
+            ++levels[bucket(level)];
+    }
+
+    // Return the stamp of a publish topic, it changes whenever its matches may have changed
+    stamp get(MQTT_NS::string_view const &topic) const
+    {
+        return stamp{ levels[bucket(first_level(topic))], wildcards };
+    }
 };
 
+// Value container for a multiple_subscription_map with inline storage for one value. Most
+// topic filters have a single subscriber and intermediate nodes have none, so a node needs no
+// separate allocation in the common case.
+template<typename T, typename Allocator>
+using small_subscriber_vector = boost::container::small_vector<T, 1, Allocator>;
 
-template<typename Value, template <typename, typename> class Cont = std::vector >
+template<typename Value, template <typename, typename> class Cont = std::vector, template <typename, typename> class Base = subscription_map_base,
+         typename Allocator = std::allocator<Value> >
 class multiple_subscription_map
-        : public subscription_map_base< Cont<Value, std::allocator<Value> > >
+        : public Base< subscription_slots<Value, Cont, Allocator>, Allocator >
 {
+    typedef subscription_slots<Value, Cont, Allocator> slots_type;
+
+    topic_generations generations;
 
 public:
+    // Identifies a value inserted in the map, valid until the value is removed
+    class handle
+    {
+        friend class multiple_subscription_map;
 
-    // Insert a value at the specified subscription path
-    void insert(MQTT_NS::string_view const &topic, Value const &value)
+        slots_type *slots;
+        uint32_t index;
+
+        handle(slots_type *_slots, uint32_t _index)
+                : slots(_slots), index(_index)
+        { }
+
+    public:
+        handle()
+                : slots(nullptr), index(slots_type::npos)
+        { }
+    };
+
+    // Insert a value at the specified subscription path, returns the handle to remove it with
+    handle insert(MQTT_NS::string_view const &topic, Value const &value)
     {
-        this->create_subscription(topic)->second.value.push_back(value);
+        auto &slots = this->create_subscription(topic)->value;
+        handle result(&slots, slots.insert(value));
+        generations.modified(topic);
+        return result;
     }
 
     // Remove a value at the specified subscription path
     void remove(MQTT_NS::string_view const &topic, Value const &value)
     {
         auto i = this->remove_subscription(topic);
-        if(i != this->end())
-            i->second.value.erase(std::find(i->second.value.begin(), i->second.value.end(), value));
+        if(i != nullptr) {
+            uint32_t index = i->value.find(value);
+            if(index != slots_type::npos)
+                i->value.erase(index);
+        }
+        generations.modified(topic);
+    }
+
+    // Remove the value of a handle returned by insert for the same subscription path. The
+    // value is removed without searching the other values of the subscription.
+    void remove(MQTT_NS::string_view const &topic, handle const &h)
+    {
+        auto i = this->remove_subscription(topic);
+        if(i != nullptr) {
+            BOOST_ASSERT(&i->value == h.slots);
+            i->value.erase(h.index);
+        }
+        generations.modified(topic);
+    }
+
+    // Replace the value of a handle returned by insert for the same subscription path, without
+    // searching the path
+    void replace(MQTT_NS::string_view const &topic, handle const &h, Value const &value)
+    {
+        h.slots->replace(h.index, value);
+        generations.modified(topic);
+    }
+
+    // Return the modification stamp of a publish topic, for a match_cache in front of find
+    topic_generations::stamp stamp(MQTT_NS::string_view const &topic) const
+    {
+        return generations.get(topic);
     }
 
     // Find all values that math the specified path
     void find(MQTT_NS::string_view const &topic, std::function< void (Value const &) > const &callback) const
     {
-        this->find_match(topic, [&callback]( Cont<Value, std::allocator<Value> > const &values ) {
-            for(Value const &i: values)
-                callback(i);
+        find<std::function< void (Value const &) > const &>(topic, callback);
+    }
+
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        this->find_match(topic, [&callback]( slots_type const &values ) {
+            values.for_each(callback);
         });
     }
 };
@@ -0,0 +1,322 @@
+#ifndef MQTTSUBSCRIPTION_SUBSCRIPTION_TRIE_H
+#define MQTTSUBSCRIPTION_SUBSCRIPTION_TRIE_H
+
+#include <mqtt/string_view.hpp>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/container/small_vector.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include "path_tokenizer.h"
+#include "match_frontier.h"
+
+// Index of the (non-wildcard) children of a trie node. Low fan-out nodes keep their
+// children in a small inline array which is searched linearly, once the array is full
+// the children are moved to a hash map keyed by the level of the child.
+template<typename Node, std::size_t InlineSize = 4, typename NodePtr = std::unique_ptr<Node> >
+class trie_child_index
+{
+    struct level_hash
+    {
+        std::size_t operator()(MQTT_NS::string_view const &level) const { return boost::hash_range(level.begin(), level.end()); }
+    };
+
+    typedef boost::unordered_map< MQTT_NS::string_view, NodePtr, level_hash > large_index_type;
+
+    NodePtr small[InlineSize];
+    std::size_t small_size;
+    std::unique_ptr<large_index_type> large;
+
+    void move_to_large()
+    {
+        large.reset(new large_index_type());
+        for(std::size_t i = 0; i < small_size; ++i) {
+            MQTT_NS::string_view key(small[i]->key);
+            large->emplace(key, std::move(small[i]));
+        }
+        small_size = 0;
+    }
+
+    void move_to_small()
+    {
+        for(auto &i: *large)
+            small[small_size++] = std::move(i.second);
+        large.reset();
+    }
+
+public:
+    trie_child_index()
+            : small_size(0)
+    { }
+
+    std::size_t size() const { return large ? large->size() : small_size; }
+
+    Node *find(MQTT_NS::string_view const &key) const
+    {
+        if(large) {
+            auto i = large->find(key);
+            return i == large->end() ? nullptr : i->second.get();
+        }
+
+        for(std::size_t i = 0; i < small_size; ++i)
+            if(MQTT_NS::string_view(small[i]->key) == key)
+                return small[i].get();
+
+        return nullptr;
+    }
+
+    // Insert a new child, the child should not exist yet
+    Node *insert(NodePtr node)
+    {
+        Node *result = node.get();
+
+        if(!large && small_size == InlineSize)
+            move_to_large();
+
+        if(large) {
+            MQTT_NS::string_view key(node->key);
+            large->emplace(key, std::move(node));
+        } else {
+            small[small_size++] = std::move(node);
+        }
+
+        return result;
+    }
+
+    // Erase (and destroy) a child of this index
+    void erase(Node *node)
+    {
+        if(large) {
+            large->erase(large->find(MQTT_NS::string_view(node->key)));
+            // Only go back to the inline array at half capacity, to avoid moving back
+            // and forth when a subscription at the boundary is added and removed
+            if(large->size() <= InlineSize / 2)
+                move_to_small();
+            return;
+        }
+
+        for(std::size_t i = 0; i < small_size; ++i) {
+            if(small[i].get() == node) {
+                // The last child is moved into the slot of the erased child
+                if(i != small_size - 1)
+                    small[i] = std::move(small[small_size - 1]);
+                small[small_size - 1].reset();
+                --small_size;
+                return;
+            }
+        }
+    }
+};
+
+// Subscription map backend where every node owns its children. The exact children are
+// stored in a trie_child_index, the wildcard children are directly referenced by the
+// node. Has the same interface as subscription_map_base, the nodes are allocated with
+// (a rebound copy of) Allocator, which should be stateless.
+template<typename Value, typename Allocator = std::allocator<Value> >
+class subscription_trie_base
+{
+    struct path_entry;
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<path_entry> node_allocator;
+    typedef std::allocator_traits<node_allocator> node_allocator_traits;
+
+    struct node_deleter
+    {
+        void operator()(path_entry *node) const
+        {
+            node_allocator allocator;
+            node_allocator_traits::destroy(allocator, node);
+            node_allocator_traits::deallocate(allocator, node, 1);
+        }
+    };
+
+    typedef std::unique_ptr<path_entry, node_deleter> node_ptr;
+
+    struct path_entry
+    {
+        std::string key;
+        uint32_t count;
+
+        Value value;
+
+        trie_child_index<path_entry, 4, node_ptr> children;
+        node_ptr plus_child;
+        node_ptr hash_child;
+
+        path_entry(MQTT_NS::string_view const &_key)
+                : key(_key.data(), _key.size()), count(1)
+        { }
+
+        path_entry *find_child(MQTT_NS::string_view const &level) const
+        {
+            if(level == "+")
+                return plus_child.get();
+            if(level == "#")
+                return hash_child.get();
+            return children.find(level);
+        }
+
+        path_entry *insert_child(MQTT_NS::string_view const &level)
+        {
+            node_allocator allocator;
+            path_entry *p = node_allocator_traits::allocate(allocator, 1);
+            try {
+                node_allocator_traits::construct(allocator, p, level);
+            } catch(...) {
+                node_allocator_traits::deallocate(allocator, p, 1);
+                throw;
+            }
+
+            node_ptr child(p);
+            path_entry *result = child.get();
+
+            if(level == "+")
+                plus_child = std::move(child);
+            else if(level == "#")
+                hash_child = std::move(child);
+            else
+                children.insert(std::move(child));
+
+            return result;
+        }
+
+        void erase_child(path_entry *child)
+        {
+            if(child == plus_child.get())
+                plus_child.reset();
+            else if(child == hash_child.get())
+                hash_child.reset();
+            else
+                children.erase(child);
+        }
+    };
+
+    path_entry root;
+    size_t node_count;
+
+protected:
+    // The (parent, entry) pairs on the path of a subscription, inline for common topic depths
+    typedef boost::container::small_vector< std::pair<path_entry *, path_entry *>, 8 > path_type;
+
+    path_type find_subscription(MQTT_NS::string_view const &topic)
+    {
+        auto tokens = mqtt_path_tokenizer(topic);
+        path_entry *parent = &root;
+
+        path_type path;
+
+        for (auto const  &t : tokens) {
+            path_entry *entry = parent->find_child(t);
+
+            if(entry == nullptr) {
+                path.clear();
+                break;
+            }
+
+            path.push_back(std::make_pair(parent, entry));
+            parent = entry;
+        }
+
+        return path;
+    }
+
+    // Create the path for a subscription and return its (leaf) entry
+    path_entry *create_subscription(MQTT_NS::string_view const &topic)
+    {
+        auto tokens = mqtt_path_tokenizer(topic);
+
+        path_entry *parent = &root;
+        for (auto const  &t : tokens) {
+            path_entry *entry = parent->find_child(t);
+
+            if(entry == nullptr) {
+                entry = parent->insert_child(t);
+                ++node_count;
+            } else {
+                entry->count++;
+            }
+
+            parent = entry;
+        }
+
+        return parent;
+    }
+
+    // Remove a value at the specified subscription path, returns the entry when it still exists afterwards
+    path_entry *remove_subscription(MQTT_NS::string_view const &topic)
+    {
+        auto path = find_subscription(topic);
+        if(path.empty())
+            return nullptr;
+
+        path_entry *result = path.back().second;
+
+        for(size_t i = 0; i < path.size(); ++i)
+        {
+            path_entry *parent = path[path.size() - i - 1].first;
+            path_entry *entry = path[path.size() - i - 1].second;
+
+            --(entry->count);
+            if(entry->count == 0) {
+                // Children of entry are already removed, as their counts are included in the count of entry
+                parent->erase_child(entry);
+                --node_count;
+                if(i == 0)
+                    result = nullptr;
+            }
+        }
+
+        return result;
+    }
+
+    // Find all values that math the specified path, callback is called as callback(Value const &)
+    template<typename Output>
+    void find_match(MQTT_NS::string_view const &topic, Output &&callback) const
+    {
+        auto tokens = mqtt_path_tokenizer(topic);
+
+        typename match_frontier<path_entry const *>::lease entries;
+        entries->current().push_back(&root);
+
+        // Wildcards at the first level do not match topics starting with $, like the $SYS topics
+        bool system_topic = !topic.empty() && topic.front() == '$';
+
+        for (auto const  &t : tokens) {
+            for(path_entry const *entry: entries->current()) {
+                path_entry const *i = entry->children.find(t);
+                if(i != nullptr)
+                    entries->next().push_back(i);
+
+                if(system_topic && entry == &root)
+                    continue;
+
+                if(entry->plus_child)
+                    entries->next().push_back(entry->plus_child.get());
+
+                if(entry->hash_child)
+                    callback(entry->hash_child->value);
+            }
+
+            if(entries->next().empty())
+                return;
+            entries->advance();
+        }
+
+        for(path_entry const *entry: entries->current())
+            callback(entry->value);
+    }
+
+    subscription_trie_base()
+            : root(""), node_count(1)
+    { }
+
+public:
+    // Return the number of elements in the tree
+    size_t size() const { return node_count; }
+};
+
+#endif //MQTTSUBSCRIPTION_SUBSCRIPTION_TRIE_H
@@ -0,0 +1,164 @@
+#ifndef MQTTSUBSCRIPTION_TIMING_WHEEL_H
+#define MQTTSUBSCRIPTION_TIMING_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// Hierarchical timing wheel, for timers which are reset far more often than they expire, like
+// the keep-alive of connections. Time is counted in ticks, four levels of 64 slots cover 64^4
+// ticks. A timer is stored in the slot of the lowest level which covers its expiry, and moves
+// down a level each time the slot of the level below wraps around. Inserting, resetting and
+// cancelling a timer are O(1), advancing the wheel is O(1) per tick plus the expired timers.
+//
+// A timer is a hook embedded in its owner, the wheel does not allocate. A hook unlinks itself
+// when it is destroyed. Not thread safe, intended as a wheel per thread for the timers of the
+// connections of the thread.
+template<typename Owner>
+class timing_wheel
+{
+public:
+    typedef std::uint64_t tick_type;
+
+    class hook
+    {
+        friend class timing_wheel;
+
+        hook *prev = nullptr;
+        hook *next = nullptr;
+        tick_type expiry = 0;
+        Owner *owner;
+
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+
+    public:
+        explicit hook(Owner *_owner = nullptr)
+                : owner(_owner)
+        { }
+
+        hook(hook const &) = delete;
+        hook &operator=(hook const &) = delete;
+
+        ~hook()
+        {
+            if(linked())
+                unlink();
+        }
+
+        bool linked() const { return next != nullptr; }
+    };
+
+private:
+    enum : unsigned { slot_bits = 6, slots_per_level = 1u << slot_bits, levels = 4 };
+    static constexpr tick_type slot_mask = slots_per_level - 1;
+    static constexpr tick_type max_delay = (tick_type(1) << (slot_bits * levels)) - 1;
+
+    // The sentinel of the circular list of every slot
+    std::array<std::array<hook, slots_per_level>, levels> slots;
+    tick_type current;
+
+    void link(hook &h)
+    {
+        // Timers beyond the range of the wheel wait in the top level, and are placed again
+        // when their slot is cascaded
+        tick_type position = std::min(h.expiry, current + max_delay);
+        tick_type delay = position - current;
+
+        unsigned level = 0;
+        while(delay >= (tick_type(1) << (slot_bits * (level + 1))))
+            ++level;
+
+        hook &sentinel = slots[level][(position >> (slot_bits * level)) & slot_mask];
+        h.prev = sentinel.prev;
+        h.next = &sentinel;
+        sentinel.prev->next = &h;
+        sentinel.prev = &h;
+    }
+
+    // Place the timers of a slot in the lower levels
+    void cascade(unsigned level, std::size_t slot)
+    {
+        hook &sentinel = slots[level][slot];
+        while(sentinel.next != &sentinel) {
+            hook &h = *sentinel.next;
+            h.unlink();
+            link(h);
+        }
+    }
+
+public:
+    explicit timing_wheel(tick_type now)
+            : current(now)
+    {
+        for(auto &level: slots) {
+            for(auto &sentinel: level)
+                sentinel.prev = sentinel.next = &sentinel;
+        }
+    }
+
+    timing_wheel(timing_wheel const &) = delete;
+    timing_wheel &operator=(timing_wheel const &) = delete;
+
+    ~timing_wheel()
+    {
+        for(auto &level: slots) {
+            for(auto &sentinel: level) {
+                while(sentinel.next != &sentinel)
+                    sentinel.next->unlink();
+                sentinel.prev = sentinel.next = nullptr;
+            }
+        }
+    }
+
+    // Start or restart timer h, it expires once the wheel is advanced to expiry. An expiry which
+    // already passed expires on the next tick
+    void schedule(hook &h, tick_type expiry)
+    {
+        if(h.linked())
+            h.unlink();
+
+        h.expiry = std::max(expiry, current + 1);
+        link(h);
+    }
+
+    void cancel(hook &h)
+    {
+        if(h.linked())
+            h.unlink();
+    }
+
+    // Advance the wheel to now, call expired(Owner &) for every timer which expired. The handler
+    // may schedule and cancel timers, including the expired one
+    template<typename F>
+    void advance(tick_type now, F &&expired)
+    {
+        while(current < now) {
+            ++current;
+
+            if((current & slot_mask) == 0) {
+                for(unsigned level = 1; level < levels; ++level) {
+                    std::size_t slot = (current >> (slot_bits * level)) & slot_mask;
+                    cascade(level, slot);
+                    if(slot != 0)
+                        break;
+                }
+            }
+
+            hook &sentinel = slots[0][current & slot_mask];
+            while(sentinel.next != &sentinel) {
+                hook &h = *sentinel.next;
+                h.unlink();
+                expired(*h.owner);
+            }
+        }
+    }
+
+    tick_type now() const { return current; }
+};
+
+#endif //MQTTSUBSCRIPTION_TIMING_WHEEL_H
@@ -0,0 +1,212 @@
+#ifndef MQTTSUBSCRIPTION_TOPIC_LEVEL_POOL_H
+#define MQTTSUBSCRIPTION_TOPIC_LEVEL_POOL_H
+
+#include <mqtt/string_view.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include "path_tokenizer.h"
+
+// Interned topic levels, shared by the topic maps. Every distinct level string is stored once
+// and identified by a 32-bit id, nodes of the maps store the id of their level. A level is
+// reference counted by the nodes using it, its id is reused once the last node releases it.
+//
+// Ids of levels that are no longer used can be reused for another level, so ids looked up
+// with find are only valid while the map they are used with cannot change. Thread safe,
+// lookups are answered from a cache of the calling thread and only lock the pool on a miss.
+class topic_level_pool
+{
+public:
+    typedef uint32_t level_id;
+
+    static constexpr level_id npos = std::numeric_limits<level_id>::max();
+
+    // The wildcards are interned on construction and never released
+    enum : level_id { plus_level = 0, hash_level = 1 };
+
+private:
+    struct level_hash
+    {
+        std::size_t operator()(MQTT_NS::string_view const &level) const { return boost::hash_range(level.begin(), level.end()); }
+    };
+
+    struct entry
+    {
+        std::string level;
+        uint32_t references;
+    };
+
+    // The ids a thread looked up. Hits are valid until a level is removed, as its id can be
+    // reused, levels not found are valid until a level is added.
+    struct thread_cache
+    {
+        struct cached
+        {
+            level_id id;
+            uint64_t added;
+        };
+
+        static constexpr std::size_t capacity = 65536;
+
+        topic_level_pool const *pool = nullptr;
+        uint64_t removed = 0;
+
+        std::deque<std::string> levels;
+        boost::unordered_map< MQTT_NS::string_view, cached, level_hash > index;
+
+        void clear(topic_level_pool const *_pool, uint64_t _removed)
+        {
+            index.clear();
+            levels.clear();
+            pool = _pool;
+            removed = _removed;
+        }
+    };
+
+    mutable std::shared_mutex mutex;
+
+    // Changed when a level is added to or removed from the index, read by the thread caches
+    std::atomic<uint64_t> added_generation{0};
+    std::atomic<uint64_t> removed_generation{0};
+
+    // A deque does not move its elements, so the index can refer to the stored strings
+    std::deque<entry> entries;
+    std::vector<level_id> free_ids;
+    boost::unordered_map< MQTT_NS::string_view, level_id, level_hash > index;
+
+    level_id find_locked(MQTT_NS::string_view const &level) const
+    {
+        auto i = index.find(level);
+        return i == index.end() ? npos : i->second;
+    }
+
+    // The maps look up levels with the map locked. Levels used by that map are not added or
+    // removed meanwhile, and changes made before the map was locked are visible to the acquire
+    // loads of the generations.
+    level_id find_cached(thread_cache &cache, MQTT_NS::string_view const &level) const
+    {
+        uint64_t removed = removed_generation.load(std::memory_order_acquire);
+        uint64_t added = added_generation.load(std::memory_order_acquire);
+
+        if(cache.pool != this || cache.removed != removed || cache.index.size() >= thread_cache::capacity)
+            cache.clear(this, removed);
+
+        auto i = cache.index.find(level);
+        if(i != cache.index.end() && (i->second.id != npos || i->second.added == added))
+            return i->second.id;
+
+        level_id id;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            id = find_locked(level);
+        }
+
+        if(i != cache.index.end()) {
+            i->second = { id, added };
+        } else {
+            cache.levels.emplace_back(level.data(), level.size());
+            cache.index.emplace(MQTT_NS::string_view(cache.levels.back()), thread_cache::cached{ id, added });
+        }
+        return id;
+    }
+
+    static thread_cache &local_cache()
+    {
+        static thread_local thread_cache cache;
+        return cache;
+    }
+
+public:
+    topic_level_pool()
+    {
+        intern("+");
+        intern("#");
+    }
+
+    topic_level_pool(topic_level_pool const &) = delete;
+    topic_level_pool &operator=(topic_level_pool const &) = delete;
+
+    // The pool shared by all topic maps
+    static topic_level_pool &instance()
+    {
+        static topic_level_pool pool;
+        return pool;
+    }
+
+    // Return the id of a level and add a reference to it, the level is added when it does not exist
+    level_id intern(MQTT_NS::string_view const &level)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        level_id id = find_locked(level);
+        if(id != npos) {
+            ++entries[id].references;
+            return id;
+        }
+
+        if(free_ids.empty()) {
+            if(entries.size() == npos)
+                throw std::overflow_error("Too many topic levels");
+            id = static_cast<level_id>(entries.size());
+            entries.emplace_back();
+        } else {
+            id = free_ids.back();
+            free_ids.pop_back();
+        }
+
+        entries[id].level.assign(level.data(), level.size());
+        entries[id].references = 1;
+        index.emplace(MQTT_NS::string_view(entries[id].level), id);
+        added_generation.fetch_add(1, std::memory_order_release);
+        return id;
+    }
+
+    // Remove a reference added by intern
+    void release(level_id id)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        entry &e = entries[id];
+        if(--e.references != 0)
+            return;
+
+        index.erase(MQTT_NS::string_view(e.level));
+        std::string().swap(e.level);
+        free_ids.push_back(id);
+        removed_generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Return the id of a level, npos when no map uses the level
+    level_id find(MQTT_NS::string_view const &level) const
+    {
+        return find_cached(local_cache(), level);
+    }
+
+    // Append the ids of all levels of a topic to levels
+    template<typename Levels>
+    void find_levels(MQTT_NS::string_view const &topic, Levels &levels) const
+    {
+        thread_cache &cache = local_cache();
+        for(auto const &t: mqtt_path_tokenizer(topic))
+            levels.push_back(find_cached(cache, t));
+    }
+
+    // Return the number of interned levels, including the wildcards
+    size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return index.size();
+    }
+};
+
+#endif //MQTTSUBSCRIPTION_TOPIC_LEVEL_POOL_H